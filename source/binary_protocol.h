@@ -0,0 +1,86 @@
+#pragma once
+
+#include <bit>
+#include <cstdint>
+#include <cstring>
+#include <optional>
+#include <string>
+#include <string_view>
+
+/**
+ ** The compact wire encoding of the single-key operations, next to the
+ ** length-prefixed server_msg frames.
+ **
+ ** A client opts in by sending binary_magic as the first byte of its
+ ** connection; every frame in both directions is then a BinaryHeader in
+ ** little-endian order followed by value_size raw value bytes. A server_msg
+ ** connection never starts with that byte, since its first byte is the top
+ ** byte of a length below max_message_size. The header has a fixed layout,
+ ** so the server reads it with one copy of 32 bytes and takes the value in
+ ** place from the receive buffer: no varints, no presence bits and no
+ ** strings.
+ **
+ ** Requests are GET, PUT, DELETE and MERGE, numbered like in server_msg;
+ ** every request is answered, in order unless the client pipelines them,
+ ** then by request_id. Any other operation is answered without
+ ** binary_success.
+ **/
+
+inline constexpr unsigned char binary_magic = 0xB1;
+
+struct BinaryHeader {
+  uint8_t operation;  // a server_msg::Operation
+  uint8_t flags;      // of a response: binary_success, binary_key_exists
+  uint8_t counter_op; // the server_msg::CounterOp of a MERGE
+  uint8_t reserved;
+  int32_t key;
+  uint64_t request_id; // echoed in the response
+  int64_t arg; // PUT: ttl_ms, 0 never; MERGE: operand; GET response: ttl_ms left
+  uint32_t value_size; // bytes of the value after the header
+  uint32_t map_version; // low 32 bits of the map_version of server_msg, 0 for none
+};
+
+static_assert(sizeof(BinaryHeader) == 32, "the header is a wire format");
+static_assert(std::endian::native == std::endian::little,
+              "the header is read in place as little-endian");
+
+inline constexpr uint8_t binary_success = 1;
+inline constexpr uint8_t binary_key_exists = 2; // a GET found the key
+inline constexpr uint8_t binary_stale_map = 4;  // rejected, see map_version
+
+inline auto read_binary_header(const char *frame) noexcept -> BinaryHeader {
+  BinaryHeader header;
+  std::memcpy(&header, frame, sizeof(header));
+  return header;
+}
+
+inline auto append_binary_frame(std::string &out, BinaryHeader header,
+                                std::string_view value) -> void {
+  header.value_size = static_cast<uint32_t>(value.size());
+  auto offset = out.size();
+  out.resize(offset + sizeof(header) + value.size());
+  std::memcpy(out.data() + offset, &header, sizeof(header));
+  std::memcpy(out.data() + offset + sizeof(header), value.data(),
+              value.size());
+}
+
+/**
+ ** It returns how many leading bytes of buf are complete binary frames, like
+ ** complete_frames(), or nothing if a frame announces a value above
+ ** max_value_size.
+ **/
+inline auto complete_binary_frames(std::string_view buf, uint32_t max_value_size)
+    -> std::optional<size_t> {
+  size_t offset = 0;
+  while (buf.size() - offset >= sizeof(BinaryHeader)) {
+    auto header = read_binary_header(buf.data() + offset);
+    if (header.value_size > max_value_size) {
+      return std::nullopt;
+    }
+    if (buf.size() - offset - sizeof(BinaryHeader) < header.value_size) {
+      break;
+    }
+    offset += sizeof(BinaryHeader) + header.value_size;
+  }
+  return offset;
+}
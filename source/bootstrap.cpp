@@ -0,0 +1,286 @@
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <filesystem>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "bootstrap.h"
+
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "key_encoding.h"
+#include "rocksdb/sst_file_writer.h"
+#include "rocksdb/write_batch.h"
+#include "shared.h"
+#include "value_ttl.h"
+
+namespace {
+
+constexpr int accept_timeout_ms = 60 * 1000;
+constexpr size_t receive_chunk_size = 1 << 20;
+constexpr size_t size_field_size = sizeof(uint64_t);
+
+auto store_uint64(char *out, uint64_t value) -> void {
+  for (size_t i = 0; i < sizeof(value); ++i) {
+    out[i] = static_cast<char>(value >> (8 * i));
+  }
+}
+
+auto load_uint64(const char *in) -> uint64_t {
+  uint64_t value = 0;
+  for (size_t i = 0; i < sizeof(value); ++i) {
+    value |= static_cast<uint64_t>(static_cast<unsigned char>(in[i]))
+             << (8 * i);
+  }
+  return value;
+}
+
+/* A new file for each transfer, even between the shards of one process. */
+auto staging_path() -> std::string {
+  static std::atomic<uint64_t> next{0};
+  auto name = "kv-bootstrap-" + std::to_string(getpid()) + "-" +
+              std::to_string(next++) + ".sst";
+  return std::filesystem::temp_directory_path() / name;
+}
+
+auto remove_file(std::string const &path) -> void {
+  std::error_code ec;
+  std::filesystem::remove(path, ec);
+}
+
+/* @return false if the peer closed or failed before size bytes arrived */
+auto recv_all(int fd, char *buffer, size_t size) -> bool {
+  size_t done = 0;
+  while (done < size) {
+    auto n = recv(fd, buffer + done, size - done, 0);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return false;
+    }
+    done += static_cast<size_t>(n);
+  }
+  return true;
+}
+
+auto write_all(int fd, const char *buffer, size_t size) -> bool {
+  size_t done = 0;
+  while (done < size) {
+    auto n = write(fd, buffer + done, size - done);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return false;
+    }
+    done += static_cast<size_t>(n);
+  }
+  return true;
+}
+
+/* It copies the next size bytes of the socket fd into a new file at path. */
+auto receive_file(int fd, uint64_t size, std::string const &path) -> bool {
+  int out = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (out < 0) {
+    return false;
+  }
+  std::vector<char> buffer(std::min<uint64_t>(size, receive_chunk_size));
+  bool ok = true;
+  for (uint64_t left = size; ok && left > 0;) {
+    auto chunk = static_cast<size_t>(std::min<uint64_t>(left, buffer.size()));
+    ok = recv_all(fd, buffer.data(), chunk) &&
+         write_all(out, buffer.data(), chunk);
+    left -= chunk;
+  }
+  return close(out) == 0 && ok;
+}
+
+/* It receives the file of one transfer on fd and ingests it. */
+auto ingest_stream(Store const &store, int fd) -> rocksdb::Status {
+  char size_field[size_field_size];
+  if (!recv_all(fd, size_field, sizeof(size_field))) {
+    return rocksdb::Status::IOError("the sender closed before the file size");
+  }
+  auto size = load_uint64(size_field);
+  /* None of the keys had a live value */
+  if (size == 0) {
+    return rocksdb::Status::OK();
+  }
+  auto path = staging_path();
+  if (!receive_file(fd, size, path)) {
+    remove_file(path);
+    return rocksdb::Status::IOError("could not receive the file", path);
+  }
+  auto status = store.engine->ingest(path);
+  remove_file(path);
+  /* The cache does not know which keys the file held */
+  if (status.ok() && store.cache != nullptr) {
+    store.cache->invalidate_all();
+  }
+  return status;
+}
+
+auto run_receiver(Store store, int listen_fd) -> void {
+  pollfd ready{listen_fd, POLLIN, 0};
+  int fd = -1;
+  if (poll(&ready, 1, accept_timeout_ms) > 0) {
+    fd = accept_connection(listen_fd);
+  }
+  close(listen_fd);
+  if (fd < 0) {
+    debug_print("[{}] no sender connected\n", __func__);
+    return;
+  }
+  auto status = ingest_stream(store, fd);
+  if (!status.ok()) {
+    debug_print("[{}] {}\n", __func__, status.ToString());
+  }
+  char ack = status.ok() ? 1 : 0;
+  secure_send(fd, &ack, sizeof(ack));
+  close(fd);
+}
+
+/**
+ ** It writes the live values of keys into an SST file at path.
+ **
+ ** @param nb_values set to the number of values written; without any no
+ ** file is created, since an SST file cannot be empty
+ **/
+auto write_sst(StorageEngine *engine, std::span<int32_t const> keys,
+               std::string const &path, size_t *nb_values) -> rocksdb::Status {
+  /* The encoding keeps the numeric order, and SST keys must ascend */
+  std::vector<int32_t> sorted(keys.begin(), keys.end());
+  std::sort(sorted.begin(), sorted.end());
+  sorted.erase(std::unique(sorted.begin(), sorted.end()), sorted.end());
+
+  /* The writer keeps pointers into options */
+  rocksdb::Options options;
+  rocksdb::SstFileWriter writer(rocksdb::EnvOptions(), options);
+  rocksdb::PinnableSlice value;
+  auto now = now_ms();
+  *nb_values = 0;
+  for (auto key : sorted) {
+    auto encoded = encode_key(key);
+    value.Reset();
+    auto status = engine->get(key_slice(encoded), &value);
+    if (status.IsNotFound()) {
+      continue;
+    }
+    if (!status.ok()) {
+      return status;
+    }
+    /* The stored form is copied, so a moved key keeps its expiry */
+    if (load_value(value).expired(now)) {
+      continue;
+    }
+    if (*nb_values == 0) {
+      status = writer.Open(path);
+      if (!status.ok()) {
+        return status;
+      }
+    }
+    status = writer.Put(key_slice(encoded), value);
+    if (!status.ok()) {
+      return status;
+    }
+    ++*nb_values;
+  }
+  return *nb_values > 0 ? writer.Finish() : rocksdb::Status::OK();
+}
+
+/**
+ ** It streams the file at path, or an empty transfer if path is empty, to
+ ** the receiver at peer_port and waits until it is ingested.
+ **/
+auto stream_file(std::string const &path, int peer_port) -> rocksdb::Status {
+  int file = -1;
+  struct stat info {};
+  if (!path.empty()) {
+    file = open(path.c_str(), O_RDONLY);
+    if (file < 0 || fstat(file, &info) < 0) {
+      if (file >= 0) {
+        close(file);
+      }
+      return rocksdb::Status::IOError("could not open the file", path);
+    }
+  }
+  int fd = connect_socket("localhost", peer_port);
+  if (fd < 0) {
+    if (file >= 0) {
+      close(file);
+    }
+    return rocksdb::Status::IOError("could not connect to the receiver");
+  }
+  auto size = static_cast<uint64_t>(info.st_size);
+  char size_field[size_field_size];
+  store_uint64(size_field, size);
+  bool ok = secure_send(fd, size_field, sizeof(size_field)).has_value();
+  off_t offset = 0;
+  while (ok && static_cast<uint64_t>(offset) < size) {
+    auto n = sendfile(fd, file, &offset, size - offset);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    ok = n > 0;
+  }
+  char ack = 0;
+  ok = ok && recv_all(fd, &ack, sizeof(ack)) && ack == 1;
+  close(fd);
+  if (file >= 0) {
+    close(file);
+  }
+  return ok ? rocksdb::Status::OK()
+            : rocksdb::Status::IOError("the receiver did not ingest the file");
+}
+
+} // namespace
+
+auto receive_sst(Store const &store) -> std::optional<int> {
+  int listen_fd = listening_socket(0);
+  if (listen_fd < 0) {
+    return std::nullopt;
+  }
+  sockaddr_in addr{};
+  socklen_t len = sizeof(addr);
+  if (getsockname(listen_fd, reinterpret_cast<sockaddr *>(&addr), &len) < 0) {
+    close(listen_fd);
+    return std::nullopt;
+  }
+  std::thread(run_receiver, store, listen_fd).detach();
+  return ntohs(addr.sin_port);
+}
+
+auto send_sst(Store const &store, std::span<int32_t const> keys, int peer_port)
+    -> rocksdb::Status {
+  auto path = staging_path();
+  size_t nb_values = 0;
+  auto status = write_sst(store.engine, keys, path, &nb_values);
+  if (status.ok()) {
+    status = stream_file(nb_values > 0 ? path : std::string(), peer_port);
+  }
+  remove_file(path);
+  if (!status.ok()) {
+    return status;
+  }
+  rocksdb::WriteBatch batch;
+  for (auto key : keys) {
+    auto encoded = encode_key(key);
+    batch.Delete(key_slice(encoded));
+  }
+  status = store.engine->write(&batch, false);
+  if (store.cache != nullptr) {
+    for (auto key : keys) {
+      store.cache->invalidate(key);
+    }
+  }
+  return status;
+}
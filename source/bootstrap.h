@@ -0,0 +1,40 @@
+#pragma once
+
+#include <cstdint>
+#include <optional>
+#include <span>
+
+#include "request_handler.h"
+#include "rocksdb/status.h"
+
+/**
+ ** Bulk transfer of keys from one server to another, for the rebalancing on
+ ** a join.
+ **
+ ** The receiver opens a one-shot listener on an ephemeral port. The sender
+ ** writes the live values of the keys, in key order, into one SST file with
+ ** rocksdb::SstFileWriter and streams it to that port with sendfile(): an
+ ** 8-byte little-endian file size, then the file. The receiver writes the
+ ** stream to a file, loads it with IngestExternalFile and answers with one
+ ** byte, 1 if the file is ingested. Only then does the sender delete the
+ ** keys. Both ends run on connections of their own, outside of the I/O
+ ** threads, so the values cost no request per key and skip the memtable and
+ ** the WAL of the receiver.
+ **/
+
+/**
+ ** It opens the listener of a transfer into store; the transfer runs on a
+ ** thread of its own, which gives up if no sender connects within a minute.
+ **
+ ** @return the port of the listener, or nothing if it could not be opened
+ **/
+auto receive_sst(Store const &store) -> std::optional<int>;
+
+/**
+ ** It sends the values of keys in store to the receiver listening at
+ ** peer_port and deletes them from store once the receiver ingested them.
+ ** Expired and missing keys are skipped. It blocks for the whole transfer,
+ ** so BOOTSTRAP_SEND calls it on a thread of its own.
+ **/
+auto send_sst(Store const &store, std::span<int32_t const> keys, int peer_port)
+    -> rocksdb::Status;
@@ -11,39 +11,750 @@
 #include <netdb.h>
 #include <cxxopts.hpp>
 #include <fcntl.h>
+#include <algorithm>
+#include <cstdio>
+#include <filesystem>
 #include <fstream>
+#include <map>
+#include <memory>
+#include <optional>
+#include <queue>
+#include <vector>
 #include <fmt/core.h>
+#include "binary_protocol.h"
+#include "counter_merge.h"
 #include "message.h"
+#include "placement.h"
 #include "shared.h"
 #include "workload_traces/generate_traces.h"
+#include <google/protobuf/arena.h>
 #include <google/protobuf/io/coded_stream.h>
 #include <google/protobuf/io/zero_copy_stream_impl.h>
 #include <google/protobuf/text_format.h>
 
 const char *hostname = "localhost";
 
+/* How often a request is routed again by a fresh shard map when a server rejects the map it was routed by */
+constexpr int max_map_refreshes = 3;
+
+/* What became of a request sent to a server */
+enum class Sent
+{
+    answered,
+    unreachable, /* the server could not be connected to, so the request was not sent */
+    lost,        /* the request was sent but not answered */
+};
+
+/* The client operations that update a counter with a MERGE. */
+const std::map<std::string, server::server_msg::CounterOp> counter_ops{
+    {"ADD", server::server_msg::ADD}, {"SUB", server::server_msg::SUB},
+    {"MULT", server::server_msg::MULT}, {"DIV", server::server_msg::DIV},
+    {"MOD", server::server_msg::MOD}, {"AND", server::server_msg::AND},
+    {"OR", server::server_msg::OR}, {"XOR", server::server_msg::XOR},
+    {"NOT", server::server_msg::NOT}, {"NAND", server::server_msg::NAND},
+    {"NOR", server::server_msg::NOR}, {"SET", server::server_msg::SET}};
+
 void error(const char *msg)
 {
     perror(msg);
     exit(0);
 }
 
+/**
+ * It sends one request to the master and waits for its response.
+ *
+ * @param master_port The port at which the master listens to.
+ * @param msg The request.
+ * @param response The response of the master.
+ *
+ * @return false if the master did not answer.
+ */
+bool ask_master(int master_port, sockets::master_msg const &msg, sockets::master_msg &response)
+{
+    /* Connecting the socket to the master. */
+    int sockfd = connect_socket(hostname, master_port);
+    if (sockfd < 0)
+    {
+        error("Error connecting master socket");
+    }
+
+    /* Send the proto message */
+    std::string frame;
+    append_serialized(frame, msg);
+    secure_send(sockfd, frame.data(), frame.size());
+
+    /* Receive the response as a proto message */
+    auto [bytecount, buffer] = secure_recv(sockfd);
+    close(sockfd);
+    if (bytecount <= 0 || buffer == nullptr)
+    {
+        return false;
+    }
+    /* Parsing the message straight from the buffer */
+    response.ParseFromArray(buffer.get(), bytecount);
+    return true;
+}
+
+/**
+ * It asks the master which server is responsible for the key.
+ *
+ * @param master_port The port at which the master listens to.
+ * @param key The key to locate.
+ *
+ * @return The port of the responsible server, or -1 on failure.
+ */
+int locate(int master_port, int key)
+{
+    sockets::master_msg msg;
+    msg.set_operation(sockets::master_msg::CLIENT_LOCATE);
+    msg.set_key(key);
+    sockets::master_msg response;
+    if (!ask_master(master_port, msg, response))
+    {
+        return -1;
+    }
+    /* Get the port from proto message */
+    return response.port();
+}
+
+/**
+ * The keys first, ..., last of a SCAN on the server at port.
+ */
+struct ScanTarget
+{
+    int port;
+    int first;
+    int last;
+};
+
+/**
+ * The shard map of the master: the servers and the placement of the keys on
+ * them, under a version that the servers check. It is fetched from the
+ * master once and kept in a file for the next runs, so that the client only
+ * asks the master again when a server rejects a request as routed by an
+ * older map. While keys move, the master sends a map without a final
+ * placement, and the keys are located one by one.
+ */
+class ShardMap
+{
+public:
+    ShardMap(int master_port, std::string cache_path)
+        : master_port(master_port), cache_path(std::move(cache_path))
+    {
+    }
+
+    /**
+     * It reads the map from the cache file, or fetches it from the master.
+     *
+     * @return false if there is no map: no server joined the cluster yet.
+     */
+    bool load()
+    {
+        if (!cache_path.empty())
+        {
+            std::ifstream in(cache_path, std::ios::binary);
+            if (in && map.ParseFromIstream(&in) && build())
+            {
+                return true;
+            }
+        }
+        return refresh();
+    }
+
+    /**
+     * It fetches the map from the master, and caches it unless keys are moving.
+     *
+     * @return false if there is no map.
+     */
+    bool refresh()
+    {
+        sockets::master_msg msg;
+        msg.set_operation(sockets::master_msg::CLIENT_MAP);
+        sockets::master_msg response;
+        if (!ask_master(master_port, msg, response) || !response.has_map())
+        {
+            return false;
+        }
+        map = response.map();
+        if (!build())
+        {
+            return false;
+        }
+        if (!cache_path.empty())
+        {
+            /* A map of moving keys would be stale by the next run */
+            if (map.migrating())
+            {
+                unlink(cache_path.c_str());
+            }
+            else
+            {
+                store();
+            }
+        }
+        return true;
+    }
+
+    /**
+     * @return The port of the server of key, or -1 on failure.
+     */
+    int owner(int key) const
+    {
+        if (map.migrating())
+        {
+            return locate(master_port, key);
+        }
+        if (placement != nullptr)
+        {
+            return placement->owner(key);
+        }
+        auto it = std::upper_bound(range_starts.begin(), range_starts.end(), key);
+        return map.ranges(static_cast<int>(it - range_starts.begin()) - 1).server();
+    }
+
+    /**
+     * It stamps request with the version of the map, unless the keys were located one by one.
+     */
+    void stamp(server::server_msg &request) const
+    {
+        if (map.migrating())
+        {
+            request.clear_map_version();
+        }
+        else
+        {
+            request.set_map_version(map.version());
+        }
+    }
+
+    /**
+     * @return The keys of first, ..., last that each server may hold: in range
+     * placement the part of every range that overlaps them, on its server,
+     * otherwise all of them on every server.
+     */
+    std::vector<ScanTarget> scan_targets(int first, int last) const
+    {
+        std::vector<ScanTarget> targets;
+        if (range_starts.empty())
+        {
+            for (int port : map.servers())
+            {
+                targets.push_back({port, first, last});
+            }
+            return targets;
+        }
+        auto it = std::upper_bound(range_starts.begin(), range_starts.end(), first);
+        for (auto i = static_cast<size_t>(std::max<ptrdiff_t>(it - range_starts.begin() - 1, 0));
+             i < range_starts.size() && range_starts[i] <= last; i++)
+        {
+            int range_last = i + 1 < range_starts.size() ? range_starts[i + 1] - 1 : last;
+            targets.push_back({map.ranges(static_cast<int>(i)).server(), std::max(first, range_starts[i]),
+                               std::min(last, range_last)});
+        }
+        return targets;
+    }
+
+private:
+    /**
+     * It prepares the lookups of the keys in the map.
+     *
+     * @return false for a map without servers or of an unknown placement.
+     */
+    bool build()
+    {
+        placement.reset();
+        range_starts.clear();
+        if (map.servers_size() == 0 || map.migrating())
+        {
+            return map.servers_size() > 0;
+        }
+        if (map.placement() == "range")
+        {
+            for (auto const &range : map.ranges())
+            {
+                range_starts.push_back(range.start());
+            }
+            return !range_starts.empty();
+        }
+        placement = make_placement(map.placement(), map.vnodes());
+        if (placement == nullptr)
+        {
+            return false;
+        }
+        for (int i = 0; i < map.servers_size(); i++)
+        {
+            placement->add(map.servers(i), i < map.weights_size() ? map.weights(i) : 1);
+        }
+        return true;
+    }
+
+    /**
+     * It writes the map to a file of its own first, so that a client that
+     * runs at the same time never reads half of it.
+     */
+    void store() const
+    {
+        std::string written = fmt::format("{}.{}", cache_path, getpid());
+        {
+            std::ofstream out(written, std::ios::binary | std::ios::trunc);
+            if (!out || !map.SerializeToOstream(&out))
+            {
+                return;
+            }
+        }
+        std::rename(written.c_str(), cache_path.c_str());
+    }
+
+    int master_port;
+    std::string cache_path; /* empty to fetch the map on every run */
+    sockets::master_msg::ShardMap map;
+    std::unique_ptr<PlacementStrategy> placement; /* unless the keys are placed by range or moving */
+    std::vector<int> range_starts;                /* of the ranges of map */
+};
+
+/**
+ * @return The value of a GET as the client prints it, a counter as its number.
+ */
+std::string printable_value(const std::string &value)
+{
+    if (value.size() == counter_size && value[0] == counter_tag)
+    {
+        return std::to_string(decode_counter(value));
+    }
+    return value;
+}
+
+/**
+ * @return true if the server rejected the request as routed by another version of the shard map.
+ */
+bool stale_map(server::server_msg const &response)
+{
+    return !response.success() && response.has_map_version();
+}
+
+/**
+ * @return true if a request that shard_map routed has to be routed again by
+ * a fresh map, since its server is gone or rejected the map.
+ */
+bool reroute(const ShardMap *shard_map, Sent sent, server::server_msg const &response)
+{
+    return shard_map != nullptr && (sent == Sent::unreachable || (sent == Sent::answered && stale_map(response)));
+}
+
+/**
+ * It sends one request to the server and waits for its response.
+ *
+ * @param port The port of the server.
+ * @param request The request, tagged with a request id.
+ * @param response The response of the server.
+ */
+Sent send_request(int port, server::server_msg const &request, server::server_msg &response)
+{
+    int serverfd = connect_socket(hostname, port);
+    if (serverfd < 0)
+    {
+        return Sent::unreachable;
+    }
+
+    /* Send the proto message */
+    std::string frame;
+    append_serialized(frame, request);
+    secure_send(serverfd, frame.data(), frame.size());
+
+    /* Receive the response from the server */
+    auto [bytecount, buffer] = secure_recv(serverfd);
+    close(serverfd);
+    if (bytecount <= 0 || buffer == nullptr)
+    {
+        return Sent::lost;
+    }
+    /* Parsing the message straight from the buffer */
+    response.ParseFromArray(buffer.get(), bytecount);
+    return response.request_id() == request.request_id() ? Sent::answered : Sent::lost;
+}
+
+/**
+ * It sends one single-key request to the server at port in the binary
+ * encoding and waits for its response, like send_request().
+ *
+ * @param port The port at which the server listens to.
+ * @param request The GET, PUT or MERGE request.
+ * @param response The response, translated back into a server_msg.
+ */
+Sent send_binary_request(int port, server::server_msg const &request, server::server_msg &response)
+{
+    int serverfd = connect_socket(hostname, port);
+    if (serverfd < 0)
+    {
+        return Sent::unreachable;
+    }
+
+    BinaryHeader header{};
+    header.operation = request.operation();
+    header.counter_op = request.counter_op();
+    header.key = request.key();
+    header.request_id = request.request_id();
+    header.arg = request.operation() == server::server_msg::MERGE ? request.operand() : request.ttl_ms();
+    header.map_version = static_cast<uint32_t>(request.map_version());
+    std::string frame(1, static_cast<char>(binary_magic));
+    append_binary_frame(frame, header, request.value());
+    secure_send(serverfd, frame.data(), frame.size());
+
+    /* Receive the header of the response, then its value */
+    std::string buffer(sizeof(BinaryHeader), '\0');
+    if (!secure_recv_exact(serverfd, buffer.data(), buffer.size()))
+    {
+        close(serverfd);
+        return Sent::lost;
+    }
+    auto answer = read_binary_header(buffer.data());
+    buffer.resize(answer.value_size);
+    bool received = secure_recv_exact(serverfd, buffer.data(), buffer.size());
+    close(serverfd);
+    if (!received)
+    {
+        return Sent::lost;
+    }
+    response.set_operation(static_cast<server::server_msg::Operation>(answer.operation));
+    response.set_key(answer.key);
+    response.set_request_id(answer.request_id);
+    response.set_success((answer.flags & binary_success) != 0);
+    response.set_key_exists(answer.operation != server::server_msg::GET || (answer.flags & binary_key_exists) != 0);
+    response.set_value(std::move(buffer));
+    if (answer.operation == server::server_msg::GET && answer.arg > 0)
+    {
+        response.set_ttl_ms(answer.arg);
+    }
+    if (answer.flags & binary_stale_map)
+    {
+        response.set_map_version(answer.map_version);
+    }
+    return response.request_id() == request.request_id() ? Sent::answered : Sent::lost;
+}
+
+/**
+ * It sends a MULTIGET or MULTIPUT over the keys key, ..., key + count - 1:
+ * one batch request per responsible server.
+ *
+ * @param shard_map The map that routes the keys, or nullptr to send them all to the server at port.
+ * @param stale Set if the keys have to be routed again by a fresh map.
+ *
+ * @return The return value of the client.
+ */
+int send_batches(server::server_msg::Operation operation, int port, int key, size_t count,
+                 std::string const &value, const ShardMap *shard_map, bool &stale)
+{
+    /* The batches and their entries live on one arena, which frees them at once instead of entry by entry */
+    google::protobuf::Arena arena;
+    /* Group the keys by the server responsible for them */
+    std::map<int, server::server_msg *> batches;
+    for (size_t i = 0; i < count; i++)
+    {
+        int batch_key = key + static_cast<int>(i);
+        int batch_port = shard_map == nullptr ? port : shard_map->owner(batch_key);
+        if (batch_port < 0)
+        {
+            return 1;
+        }
+        auto *&batch = batches[batch_port];
+        if (batch == nullptr)
+        {
+            batch = google::protobuf::Arena::CreateMessage<server::server_msg>(&arena);
+            batch->set_operation(operation);
+            batch->set_key(batch_key);
+            batch->set_request_id(getpid());
+            if (shard_map != nullptr)
+            {
+                shard_map->stamp(*batch);
+            }
+        }
+        auto *entry = batch->add_entries();
+        entry->set_key(batch_key);
+        if (operation == server::server_msg::MULTI_PUT)
+        {
+            entry->set_value(value);
+        }
+    }
+
+    int ret = 0;
+    auto *response = google::protobuf::Arena::CreateMessage<server::server_msg>(&arena);
+    for (auto const &[batch_port, batch] : batches)
+    {
+        auto sent = send_request(batch_port, *batch, *response);
+        if (sent != Sent::answered || !response->success())
+        {
+            stale = reroute(shard_map, sent, *response);
+            return 1;
+        }
+        if (operation == server::server_msg::MULTI_GET && !response->key_exists())
+        {
+            ret = 2;
+        }
+    }
+    return ret;
+}
+
+/**
+ * It runs a MULTIGET or MULTIPUT like send_batches(), again with a fresh map
+ * if a server rejected the one the keys were routed by. The batches that
+ * were already answered are sent again, which is harmless for both.
+ *
+ * @return The return value of the client.
+ */
+int run_batch(server::server_msg::Operation operation, int port, int key, size_t count,
+              std::string const &value, ShardMap *shard_map)
+{
+    for (int refreshes = 0;; refreshes++)
+    {
+        bool stale = false;
+        int ret = send_batches(operation, port, key, count, value, shard_map, stale);
+        if (!stale || refreshes == max_map_refreshes || !shard_map->refresh())
+        {
+            return ret;
+        }
+    }
+}
+
+/**
+ * The SCAN of one server: it reads the response frames as the merge needs
+ * their pairs, and scans again from the resume key if the server stopped
+ * early.
+ */
+class ShardScan
+{
+public:
+    ShardScan(int port, int first, int last, uint32_t limit, const ShardMap *shard_map)
+        : port(port), last(last), limit(limit), next_start(first), shard_map(shard_map)
+    {
+    }
+
+    ShardScan(ShardScan const &) = delete;
+    ShardScan &operator=(ShardScan const &) = delete;
+
+    ~ShardScan()
+    {
+        if (fd >= 0)
+        {
+            close(fd);
+        }
+    }
+
+    /**
+     * @return the next pair of the server, none once its range is done or on failure
+     */
+    const server::server_msg::Entry *peek()
+    {
+        while (pos == frame.entries_size())
+        {
+            if (!read_frame())
+            {
+                return nullptr;
+            }
+        }
+        return &frame.entries(pos);
+    }
+
+    void pop()
+    {
+        ++pos;
+        if (limit > 0)
+        {
+            --limit;
+        }
+    }
+
+    bool failed{false};
+    bool stale{false}; /* failed since the scan has to be routed again by a fresh map */
+
+private:
+    /* @return false if there is no further frame */
+    bool read_frame()
+    {
+        if (fd < 0)
+        {
+            if (!next_start || failed)
+            {
+                return false;
+            }
+            if (!send_scan())
+            {
+                failed = true;
+                stale = shard_map != nullptr;
+                return false;
+            }
+        }
+        auto [bytecount, buffer] = secure_recv(fd);
+        bool received = bytecount > 0 && buffer != nullptr && frame.ParseFromArray(buffer.get(), bytecount) &&
+                        frame.request_id() == static_cast<uint64_t>(getpid());
+        if (!received || !frame.success())
+        {
+            failed = true;
+            stale = received && shard_map != nullptr && stale_map(frame);
+            close(fd);
+            fd = -1;
+            return false;
+        }
+        pos = 0;
+        if (!frame.more())
+        {
+            close(fd);
+            fd = -1;
+            if (frame.has_resume_key())
+            {
+                next_start = frame.resume_key();
+            }
+        }
+        return true;
+    }
+
+    bool send_scan()
+    {
+        fd = connect_socket(hostname, port);
+        if (fd < 0)
+        {
+            return false;
+        }
+        server::server_msg request;
+        request.set_operation(server::server_msg::SCAN);
+        request.set_key(*next_start);
+        request.set_end_key(last);
+        request.set_limit(limit);
+        request.set_request_id(getpid());
+        if (shard_map != nullptr)
+        {
+            shard_map->stamp(request);
+        }
+        next_start.reset();
+        std::string frame;
+        append_serialized(frame, request);
+        secure_send(fd, frame.data(), frame.size());
+        return true;
+    }
+
+    int port;
+    int last;
+    uint32_t limit; /* pairs still wanted, 0 for all */
+    std::optional<int> next_start;
+    const ShardMap *shard_map; /* that the servers were found in, or nullptr */
+    int fd{-1};
+    server::server_msg frame;
+    int pos{0};
+};
+
+/**
+ * It runs a SCAN of the keys key, ..., key + count - 1 on the servers that
+ * may hold them and prints the pairs in key order, merging the ordered
+ * streams of the servers,
+ * up to limit pairs (0 for all).
+ *
+ * @param shard_map The map of the servers, or nullptr to scan the server at port only.
+ * @param stale Set if, before anything was printed, a server rejected the map.
+ *
+ * @return The return value of the client.
+ */
+int scan_shards(int port, int key, size_t count, uint32_t limit, const ShardMap *shard_map, bool &stale)
+{
+    if (count == 0)
+    {
+        return 0;
+    }
+    int last = key + static_cast<int>(count - 1);
+    std::vector<ScanTarget> targets =
+        shard_map == nullptr ? std::vector<ScanTarget>{{port, key, last}} : shard_map->scan_targets(key, last);
+    std::vector<std::unique_ptr<ShardScan>> scans;
+    for (auto const &target : targets)
+    {
+        scans.push_back(std::make_unique<ShardScan>(target.port, target.first, target.last, limit, shard_map));
+    }
+
+    using Head = std::pair<int, size_t>; /* next key of a server, index of the server */
+    std::priority_queue<Head, std::vector<Head>, std::greater<>> heads;
+    for (size_t i = 0; i < scans.size(); i++)
+    {
+        if (auto *entry = scans[i]->peek())
+        {
+            heads.emplace(entry->key(), i);
+        }
+        if (scans[i]->stale)
+        {
+            stale = true;
+            return 1;
+        }
+    }
+    /* While keys move, a key copied to its destination and not yet deleted on its source comes from both */
+    std::optional<int> last_printed;
+    for (uint32_t printed = 0; !heads.empty() && (limit == 0 || printed < limit);)
+    {
+        auto [next_key, i] = heads.top();
+        heads.pop();
+        if (next_key != last_printed)
+        {
+            fmt::print("{} {}\n", next_key, scans[i]->peek()->value());
+            last_printed = next_key;
+            printed++;
+        }
+        scans[i]->pop();
+        if (auto *entry = scans[i]->peek())
+        {
+            heads.emplace(entry->key(), i);
+        }
+    }
+
+    for (auto const &scan : scans)
+    {
+        if (scan->failed)
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * It runs a SCAN like scan_shards(), again with a fresh map if a server
+ * rejected the one the servers were found in.
+ *
+ * @return The return value of the client.
+ */
+int run_scan(int port, int key, size_t count, uint32_t limit, ShardMap *shard_map)
+{
+    for (int refreshes = 0;; refreshes++)
+    {
+        bool stale = false;
+        int ret = scan_shards(port, key, count, limit, shard_map, stale);
+        if (!stale || refreshes == max_map_refreshes || !shard_map->refresh())
+        {
+            return ret;
+        }
+    }
+}
+
 int main(int argc, char *argv[])
 {
     /* This is parsing the command line arguments. */
     cxxopts::Options options(argv[0], "Sever for the sockets benchmark");
     options.allow_unrecognised_options().add_options()(
         "p,port", "Port at which the target server listens to. This parameter should only be valid when DIRECT is set to `1`.",
-        cxxopts::value<size_t>())("o,operation", "Either a GET or PUT request",
+        cxxopts::value<size_t>())("o,operation", "Either a GET, PUT, MULTIGET, MULTIPUT or SCAN request, or a counter update: "
+                                  "ADD, SUB, MULT, DIV, MOD, AND, OR, XOR, NOT, NAND, NOR or SET",
                                   cxxopts::value<std::string>())(
         "k,key", "Key for the operation",
         cxxopts::value<size_t>())(
-        "v,value", "Value for the operation corresponding to the key. Only valid if the OPERATION is PUT.",
+        "v,value", "Value for the operation corresponding to the key. Only valid if the OPERATION is PUT, or the integer operand of a counter update.",
         cxxopts::value<std::string>())(
         "m,masterport", "Port at which the master listens to for the client.",
         cxxopts::value<std::size_t>())(
         "d,direct", "Specifies whether the client can talk to the server at port PORT.",
-        cxxopts::value<std::size_t>())("h,help", "Print help");
+        cxxopts::value<std::size_t>())(
+        "n,count", "Number of consecutive keys, starting at KEY, of a MULTIGET, MULTIPUT or SCAN.",
+        cxxopts::value<std::size_t>()->default_value("1"))(
+        "l,limit", "Maximum number of pairs a SCAN prints; 0 prints all.",
+        cxxopts::value<std::size_t>()->default_value("0"))(
+        "t,ttl", "Milliseconds after which the key of a PUT expires; 0 never expires.",
+        cxxopts::value<std::size_t>()->default_value("0"))(
+        "b,binary", "Sends a GET, PUT or counter update in the compact binary encoding instead of protobuf.")(
+        "c,map-cache", "File in which the shard map of the master is kept from one run to the next, kv-shard-map-MASTERPORT in the temporary directory by default; an empty FILE fetches the map on every run.",
+        cxxopts::value<std::string>())("h,help", "Print help");
 
     auto args = options.parse(argc, argv);
     if (args.count("help"))
@@ -100,56 +811,32 @@ int main(int argc, char *argv[])
     std::string value = args["value"].as<std::string>();
     int master_port = args["masterport"].as<size_t>();
     int direct = args["direct"].as<size_t>();
+    size_t count = args["count"].as<size_t>();
 
-    /* Client cannot talk to the server directly */
+    /* Client cannot talk to the server directly: the shard map routes the requests */
+    std::unique_ptr<ShardMap> shard_map;
     if (direct == 0)
     {
-        /* Client socket */
-        int sockfd;
-        /* Connecting the socket to the master. */
-        sockfd = connect_socket(hostname, master_port);
-        if (sockfd < 0)
-        {
-            error("Error connecting master socket");
-        }
-        /* Create proto message */
-        sockets::master_msg msg;
-        msg.set_operation(sockets::master_msg::CLIENT_LOCATE);
-        msg.set_key(key);
-
-        /* Send the proto message */
-        std::string str;
-        msg.SerializeToString(&str);
-        auto msg_size = str.size();
-        auto buf = std::make_unique<char[]>(msg_size + length_size_field);
-        construct_message(buf.get(), str.c_str(), msg_size);
-        secure_send(sockfd, buf.get(), msg_size + length_size_field);
-
-        /* Receive the port of the responsible server as a proto message */
-        auto [bytecount, buffer] = secure_recv(sockfd);
-        if (bytecount <= 0)
+        std::string cache_path = args.count("map-cache") ? args["map-cache"].as<std::string>()
+                                                         : (std::filesystem::temp_directory_path() / fmt::format("kv-shard-map-{}", master_port)).string();
+        shard_map = std::make_unique<ShardMap>(master_port, cache_path);
+        if (!shard_map->load())
         {
             return 1;
         }
-        if (buffer == nullptr || bytecount == 0)
-        {
-            return 1;
-        }
-        /* Parsing the message from the buffer */
-        sockets::master_msg response;
-        auto size = bytecount;
-        std::string master_message(buffer.get(), size);
-        response.ParseFromString(master_message);
-        /* Get the port from proto message */
-        port = response.port();
-        close(sockfd);
     }
 
-    /* Sending the operation PUT/GET to the server*/
-    int serverfd = connect_socket(hostname, port);
-    if (serverfd < 0)
+    if (operation == "MULTIGET")
+    {
+        return run_batch(server::server_msg::MULTI_GET, port, key, count, value, shard_map.get());
+    }
+    if (operation == "MULTIPUT")
     {
-        error("Error connecting socket");
+        return run_batch(server::server_msg::MULTI_PUT, port, key, count, value, shard_map.get());
+    }
+    if (operation == "SCAN")
+    {
+        return run_scan(port, key, count, args["limit"].as<size_t>(), shard_map.get());
     }
 
     /* Create proto message */
@@ -164,36 +851,55 @@ int main(int argc, char *argv[])
         server_msg.set_operation(server::server_msg::PUT);
         server_msg.set_key(key);
         server_msg.set_value(value);
+        if (args["ttl"].as<size_t>() > 0)
+        {
+            server_msg.set_ttl_ms(args["ttl"].as<size_t>());
+        }
     }
-    else
+    else if (counter_ops.count(operation))
     {
-        return 1;
+        server_msg.set_operation(server::server_msg::MERGE);
+        server_msg.set_key(key);
+        server_msg.set_counter_op(counter_ops.at(operation));
+        server_msg.set_operand(std::strtoll(value.c_str(), nullptr, 10));
     }
-
-    /* Send the proto message */
-    std::string server_str;
-    server_msg.SerializeToString(&server_str);
-    auto msg_size = server_str.size();
-    auto buf = std::make_unique<char[]>(msg_size + length_size_field);
-    construct_message(buf.get(), server_str.c_str(), msg_size);
-    secure_send(serverfd, buf.get(), msg_size + length_size_field);
-
-    /* Receive the response from the server */
-    auto [bytecount, buffer] = secure_recv(serverfd);
-    if (bytecount <= 0)
+    else
     {
         return 1;
     }
+    /* Tag the request so that its response can be told apart from the responses of other requests on the connection */
+    server_msg.set_request_id(getpid());
 
-    if (buffer == nullptr || bytecount == 0)
+    /* Sending the operation PUT/GET to the server*/
+    server::server_msg response;
+    for (int refreshes = 0;; refreshes++)
     {
-        return 1;
+        if (shard_map != nullptr)
+        {
+            port = shard_map->owner(key);
+            if (port < 0)
+            {
+                return 1;
+            }
+            shard_map->stamp(server_msg);
+        }
+        auto sent = args.count("binary") ? send_binary_request(port, server_msg, response)
+                                         : send_request(port, server_msg, response);
+        /* The server did not run the request, so it is sent again, even a counter update */
+        if (reroute(shard_map.get(), sent, response) && refreshes < max_map_refreshes)
+        {
+            if (!shard_map->refresh())
+            {
+                return 1;
+            }
+            continue;
+        }
+        if (sent != Sent::answered)
+        {
+            return 1;
+        }
+        break;
     }
-    /* Parsing the message from the buffer */
-    server::server_msg response;
-    auto size = bytecount;
-    std::string response_message(buffer.get(), size);
-    response.ParseFromString(response_message);
 
     if (response.key_exists() == false)
     {
@@ -204,7 +910,9 @@ int main(int argc, char *argv[])
     {
         return 1;
     }
-    /* Closing the socket. */
-    close(serverfd);
+    if (server_msg.operation() == server::server_msg::GET)
+    {
+        fmt::print("{}\n", printable_value(response.value()));
+    }
     return 0;
-}
\ No newline at end of file
+}
@@ -0,0 +1,130 @@
+#include <charconv>
+#include <cstring>
+#include <limits>
+
+#include "counter_merge.h"
+
+#include "value_ttl.h"
+
+namespace {
+
+auto store_int64(char *out, int64_t value) -> void {
+  auto bits = static_cast<uint64_t>(value);
+  for (size_t i = 0; i < sizeof(bits); ++i) {
+    out[i] = static_cast<char>(bits >> (8 * i));
+  }
+}
+
+auto load_int64(const char *in) -> int64_t {
+  uint64_t bits = 0;
+  for (size_t i = 0; i < sizeof(bits); ++i) {
+    bits |= static_cast<uint64_t>(static_cast<unsigned char>(in[i])) << (8 * i);
+  }
+  return static_cast<int64_t>(bits);
+}
+
+/* The arithmetic runs on uint64 so that an overflow wraps around. */
+auto apply(CounterOp op, int64_t value, int64_t operand) -> int64_t {
+  auto lhs = static_cast<uint64_t>(value);
+  auto rhs = static_cast<uint64_t>(operand);
+  switch (op) {
+  case CounterOp::add:
+    return static_cast<int64_t>(lhs + rhs);
+  case CounterOp::sub:
+    return static_cast<int64_t>(lhs - rhs);
+  case CounterOp::mult:
+    return static_cast<int64_t>(lhs * rhs);
+  case CounterOp::div:
+  case CounterOp::mod:
+    if (operand == 0 ||
+        (value == std::numeric_limits<int64_t>::min() && operand == -1)) {
+      return value;
+    }
+    return op == CounterOp::div ? value / operand : value % operand;
+  case CounterOp::bit_and:
+    return static_cast<int64_t>(lhs & rhs);
+  case CounterOp::bit_or:
+    return static_cast<int64_t>(lhs | rhs);
+  case CounterOp::bit_xor:
+    return static_cast<int64_t>(lhs ^ rhs);
+  case CounterOp::bit_not:
+    return static_cast<int64_t>(~lhs);
+  case CounterOp::nand:
+    return static_cast<int64_t>(~(lhs & rhs));
+  case CounterOp::nor:
+    return static_cast<int64_t>(~(lhs | rhs));
+  case CounterOp::set:
+    return operand;
+  }
+  return value;
+}
+
+/* Operands are only written by encode_counter_operand(). */
+auto apply_operand(int64_t value, rocksdb::Slice operand) -> int64_t {
+  return apply(static_cast<CounterOp>(operand[0]), value,
+               load_int64(operand.data() + 1));
+}
+
+auto operand_time(rocksdb::Slice operand) -> int64_t {
+  return load_int64(operand.data() + counter_size);
+}
+
+} // namespace
+
+auto encode_counter(int64_t value) -> std::string {
+  std::string out(counter_size, counter_tag);
+  store_int64(out.data() + 1, value);
+  return out;
+}
+
+auto decode_counter(rocksdb::Slice value) -> int64_t {
+  if (value.size() == counter_size && value[0] == counter_tag) {
+    return load_int64(value.data() + 1);
+  }
+  int64_t number = 0;
+  auto end = value.data() + value.size();
+  auto [ptr, ec] = std::from_chars(value.data(), end, number);
+  return ec == std::errc() && ptr == end ? number : 0;
+}
+
+auto encode_counter_operand(CounterOp op, int64_t operand, int64_t now_ms)
+    -> std::string {
+  std::string out(counter_operand_size, static_cast<char>(op));
+  store_int64(out.data() + 1, operand);
+  store_int64(out.data() + counter_size, now_ms);
+  return out;
+}
+
+auto merge_counter(rocksdb::Slice const *existing,
+                   std::span<rocksdb::Slice const> operands) -> std::string {
+  StoredValue stored{{}, 0};
+  if (existing != nullptr) {
+    stored = load_value(*existing);
+  }
+  auto value = decode_counter(stored.value);
+  for (auto const &operand : operands) {
+    if (operand.size() != counter_operand_size) {
+      continue;
+    }
+    if (stored.expired(operand_time(operand))) {
+      value = 0;
+      stored.expires_at_ms = 0;
+    }
+    value = apply_operand(value, operand);
+  }
+  auto counter = encode_counter(value);
+  std::string scratch;
+  return store_value(counter, stored.expires_at_ms, &scratch).ToString();
+}
+
+auto CounterMergeOperator::FullMergeV2(MergeOperationInput const &merge_in,
+                                       MergeOperationOutput *merge_out) const
+    -> bool {
+  merge_out->new_value =
+      merge_counter(merge_in.existing_value, merge_in.operand_list);
+  return true;
+}
+
+auto CounterMergeOperator::Name() const -> const char * {
+  return "CounterMergeOperator";
+}
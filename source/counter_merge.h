@@ -0,0 +1,72 @@
+#pragma once
+
+#include <cstdint>
+#include <span>
+#include <string>
+
+#include "rocksdb/merge_operator.h"
+#include "rocksdb/slice.h"
+
+/**
+ ** Counters updated in place with merge operands instead of a GET and a PUT.
+ **
+ ** A counter value is counter_tag followed by the int64 in little-endian
+ ** order; the tag tells it apart from the decimal strings clients PUT, which
+ ** never start with a NUL byte. A merge operand is the CounterOp byte
+ ** followed by the int64 operand and the time of the merge in milliseconds
+ ** (see value_ttl.h), both in the same order. Every operation wraps around
+ ** like two's complement and a division or modulo by zero leaves the value
+ ** unchanged, so a merge never fails.
+ **
+ ** RocksDB may apply an operand long after its merge, so the operand carries
+ ** its time: an operand onto a value that had expired by then starts from a
+ ** missing value, and one onto a live value keeps its expiry.
+ **/
+
+/* The values of server_msg.CounterOp. */
+enum class CounterOp : uint8_t {
+  add = 1,
+  sub = 2,
+  mult = 3,
+  div = 4,
+  mod = 5,
+  bit_and = 6,
+  bit_or = 7,
+  bit_xor = 8,
+  bit_not = 9,
+  nand = 10,
+  nor = 11,
+  set = 12,
+};
+
+inline constexpr char counter_tag = '\0';
+inline constexpr size_t counter_size = 1 + sizeof(int64_t);
+inline constexpr size_t counter_operand_size = 1 + 2 * sizeof(int64_t);
+
+auto encode_counter(int64_t value) -> std::string;
+
+/**
+ ** It reads a counter value; a decimal string is read as its number and
+ ** anything else as 0, like a missing value.
+ **/
+auto decode_counter(rocksdb::Slice value) -> int64_t;
+
+auto encode_counter_operand(CounterOp op, int64_t operand, int64_t now_ms)
+    -> std::string;
+
+/**
+ ** It applies operands to the stored value existing, or to a missing value if
+ ** it is null, and gives the stored result.
+ **/
+auto merge_counter(rocksdb::Slice const *existing,
+                   std::span<rocksdb::Slice const> operands) -> std::string;
+
+/**
+ ** The merge operator of the RocksDB engine for the counter operands.
+ **/
+class CounterMergeOperator : public rocksdb::MergeOperator {
+public:
+  auto FullMergeV2(MergeOperationInput const &merge_in,
+                   MergeOperationOutput *merge_out) const -> bool override;
+  [[nodiscard]] auto Name() const -> const char * override;
+};
@@ -0,0 +1,59 @@
+#include <utility>
+
+#include "group_commit.h"
+
+GroupCommitter::GroupCommitter(StorageEngine *engine,
+                               std::chrono::microseconds window,
+                               size_t max_bytes)
+    : engine(engine), window(window), max_bytes(max_bytes),
+      thread([this] { run(); }) {}
+
+GroupCommitter::~GroupCommitter() {
+  {
+    std::lock_guard l(batch_lock);
+    stopping = true;
+  }
+  batch_cond.notify_all();
+  thread.join();
+}
+
+auto GroupCommitter::write(Fill const &fill, Done &&done) -> void {
+  bool wake;
+  {
+    std::lock_guard l(batch_lock);
+    /* The first write opens the batch and starts its window. */
+    wake = waiting.empty();
+    if (wake) {
+      opened = std::chrono::steady_clock::now();
+    }
+    fill(batch);
+    waiting.push_back(std::move(done));
+    wake = wake || batch.GetDataSize() >= max_bytes;
+  }
+  if (wake) {
+    batch_cond.notify_one();
+  }
+}
+
+auto GroupCommitter::run() -> void {
+  while (true) {
+    rocksdb::WriteBatch closed;
+    std::vector<Done> writers;
+    {
+      std::unique_lock l(batch_lock);
+      batch_cond.wait(l, [this] { return stopping || !waiting.empty(); });
+      if (waiting.empty()) {
+        return;
+      }
+      batch_cond.wait_until(l, opened + window, [this] {
+        return stopping || batch.GetDataSize() >= max_bytes;
+      });
+      std::swap(closed, batch);
+      writers.swap(waiting);
+    }
+    auto status = engine->write(&closed, true);
+    for (auto &done : writers) {
+      done(status);
+    }
+  }
+}
@@ -0,0 +1,58 @@
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "rocksdb/write_batch.h"
+#include "storage_engine.h"
+
+/**
+ ** Group commit of the writes of all connections.
+ **
+ ** Writes are appended to one open WriteBatch. The commit thread closes the
+ ** batch once it is window old or holds max_bytes, writes it with one
+ ** synced WAL append and only then calls back the writers of the batch with
+ ** the status of the commit. Writes that arrive while a commit is running go
+ ** to the next batch.
+ **/
+class GroupCommitter {
+public:
+  using Fill = std::function<void(rocksdb::WriteBatch &)>;
+  using Done = std::function<void(rocksdb::Status const &)>;
+
+  GroupCommitter(StorageEngine *engine, std::chrono::microseconds window,
+                 size_t max_bytes);
+  ~GroupCommitter();
+
+  GroupCommitter(GroupCommitter const &) = delete;
+  GroupCommitter(GroupCommitter &&) = delete;
+  auto operator=(GroupCommitter const &) -> GroupCommitter & = delete;
+  auto operator=(GroupCommitter &&) -> GroupCommitter & = delete;
+
+  /**
+   ** It appends the updates of fill to the open batch; done is called on the
+   ** commit thread once the batch is durable, or failed. The writes are
+   ** called back in the order they were appended in.
+   **/
+  auto write(Fill const &fill, Done &&done) -> void;
+
+private:
+  auto run() -> void;
+
+  StorageEngine *engine;
+  std::chrono::microseconds window;
+  size_t max_bytes;
+
+  std::mutex batch_lock;
+  std::condition_variable batch_cond;
+  rocksdb::WriteBatch batch;
+  std::vector<Done> waiting;
+  std::chrono::steady_clock::time_point opened;
+  bool stopping{false};
+  std::thread thread;
+};
@@ -0,0 +1,43 @@
+#include <algorithm>
+
+#include "hash_ring.h"
+
+namespace {
+
+/* Never equal to a key_hash() input, since ports are above 0 */
+auto token_hash(int server, size_t vnode) -> uint64_t {
+  return mix64((static_cast<uint64_t>(static_cast<uint32_t>(server)) << 32) |
+               static_cast<uint32_t>(vnode));
+}
+
+} // namespace
+
+HashRing::HashRing(size_t vnodes) : vnodes(std::max<size_t>(vnodes, 1)) {}
+
+auto HashRing::add(int server, uint32_t weight) -> void {
+  remove(server);
+  auto nb_tokens = vnodes * std::max<uint32_t>(weight, 1);
+  for (size_t i = 0; i < nb_tokens; ++i) {
+    tokens.push_back({token_hash(server, i), server});
+  }
+  std::sort(tokens.begin(), tokens.end(), [](auto const &lhs, auto const &rhs) {
+    return lhs.hash != rhs.hash ? lhs.hash < rhs.hash : lhs.server < rhs.server;
+  });
+}
+
+auto HashRing::remove(int server) -> void {
+  std::erase_if(tokens,
+                [server](auto const &token) { return token.server == server; });
+}
+
+auto HashRing::owner(int32_t key) const -> int {
+  auto hash = key_hash(key);
+  auto it = std::lower_bound(
+      tokens.begin(), tokens.end(), hash,
+      [](auto const &token, uint64_t hash) { return token.hash < hash; });
+  return it == tokens.end() ? tokens.front().server : it->server;
+}
+
+auto HashRing::clone() const -> std::unique_ptr<PlacementStrategy> {
+  return std::make_unique<HashRing>(*this);
+}
@@ -0,0 +1,46 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include "placement.h"
+
+/**
+ ** Consistent-hash ring of the servers of the cluster, by port.
+ **
+ ** Every server owns vnodes tokens, points of the 64-bit hash space derived
+ ** from its port, and a key belongs to the server of the first token at or
+ ** after the hash of the key, wrapping around. A server that joins takes
+ ** over only the keys between its tokens and their predecessors, about 1/N
+ ** of them, instead of the (N-1)/N that key % N moves. The tokens depend on
+ ** the ports only, so the placement does not depend on the join order.
+ ** The tokens are a sorted array, searched in O(log(vnodes * N)). A server
+ ** of weight w gets w * vnodes tokens, and so about w times the keys.
+ **/
+class HashRing : public PlacementStrategy {
+public:
+  static constexpr size_t default_vnodes = 128;
+
+  explicit HashRing(size_t vnodes = default_vnodes);
+
+  auto add(int server, uint32_t weight = 1) -> void override;
+  auto remove(int server) -> void;
+
+  [[nodiscard]] auto owner(int32_t key) const -> int override;
+
+  [[nodiscard]] auto empty() const -> bool override { return tokens.empty(); }
+
+  [[nodiscard]] auto clone() const
+      -> std::unique_ptr<PlacementStrategy> override;
+
+private:
+  struct Token {
+    uint64_t hash;
+    int server;
+  };
+
+  size_t vnodes;
+  std::vector<Token> tokens; // by hash, then server
+};
@@ -0,0 +1,83 @@
+#pragma once
+
+#include <array>
+#include <charconv>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+
+#include "rocksdb/db.h"
+#include "rocksdb/iterator.h"
+#include "rocksdb/slice.h"
+
+/**
+ ** On-disk encoding of the keys.
+ **
+ ** A key is stored as its 4 bytes in big-endian order with the sign bit
+ ** flipped, so the bytewise order of RocksDB is the numeric order of the keys,
+ ** negative keys first. Every key of a database has this size; keys of any
+ ** other size hold metadata of the server, like format_key.
+ **/
+
+constexpr size_t encoded_key_size = sizeof(int32_t);
+using EncodedKey = std::array<char, encoded_key_size>;
+
+inline auto encode_key(int32_t key) noexcept -> EncodedKey {
+  auto bits = static_cast<uint32_t>(key) ^ 0x80000000U;
+  return {static_cast<char>(bits >> 24), static_cast<char>(bits >> 16),
+          static_cast<char>(bits >> 8), static_cast<char>(bits)};
+}
+
+inline auto decode_key(const char *data) noexcept -> int32_t {
+  const auto *bytes = reinterpret_cast<const unsigned char *>(data);
+  auto bits = (static_cast<uint32_t>(bytes[0]) << 24) |
+              (static_cast<uint32_t>(bytes[1]) << 16) |
+              (static_cast<uint32_t>(bytes[2]) << 8) |
+              static_cast<uint32_t>(bytes[3]);
+  return static_cast<int32_t>(bits ^ 0x80000000U);
+}
+
+inline auto key_slice(EncodedKey const &key) noexcept -> rocksdb::Slice {
+  return {key.data(), key.size()};
+}
+
+/* The key under which a database records the version of its format. */
+inline constexpr std::string_view format_key{"\0format", 7};
+
+/* Keys as decimal std::to_string strings; these databases have no format_key. */
+constexpr int legacy_format = 1;
+/* Keys in the fixed-width encoding above. */
+constexpr int current_format = 2;
+/* A format marker that is not a number. */
+constexpr int unknown_format = -1;
+
+/**
+ ** It reads the format version of a database.
+ **
+ ** @return 0 for an empty database without a recorded format,
+ ** unknown_format for a corrupt marker
+ **/
+inline auto read_format(rocksdb::DB *db) -> int {
+  std::string value;
+  auto status = db->Get(rocksdb::ReadOptions(),
+                        rocksdb::Slice(format_key.data(), format_key.size()),
+                        &value);
+  if (status.ok()) {
+    int format = 0;
+    auto end = value.data() + value.size();
+    auto [ptr, ec] = std::from_chars(value.data(), end, format);
+    return ec == std::errc() && ptr == end ? format : unknown_format;
+  }
+  rocksdb::ReadOptions options;
+  options.total_order_seek = true; // also with a hash index
+  std::unique_ptr<rocksdb::Iterator> it(db->NewIterator(options));
+  it->SeekToFirst();
+  return it->Valid() ? legacy_format : 0;
+}
+
+inline auto write_format(rocksdb::DB *db, int format) -> rocksdb::Status {
+  return db->Put(rocksdb::WriteOptions(),
+                 rocksdb::Slice(format_key.data(), format_key.size()),
+                 std::to_string(format));
+}
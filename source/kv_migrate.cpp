@@ -0,0 +1,139 @@
+#include <charconv>
+#include <cstdio>
+#include <memory>
+#include <string>
+#include <cxxopts.hpp>
+#include <fmt/core.h>
+#include "key_encoding.h"
+#include "rocksdb/db.h"
+#include "rocksdb/write_batch.h"
+
+/* Number of keys written per WriteBatch. */
+constexpr int keys_per_batch = 10000;
+
+/**
+ * It parses a key of the legacy format, a std::to_string of the key.
+ *
+ * @return false if the string is not such a key
+ */
+bool parse_legacy_key(const rocksdb::Slice &str, int32_t &key)
+{
+    auto end = str.data() + str.size();
+    auto [ptr, ec] = std::from_chars(str.data(), end, key);
+    return ec == std::errc() && ptr == end && std::to_string(key) == str.ToString();
+}
+
+/**
+ * It copies every key/value pair of the legacy database at src into the new
+ * database at dst with the keys in the fixed-width encoding.
+ *
+ * @return the number of copied keys, or -1 on failure
+ */
+long copy_encoded(rocksdb::DB *src, rocksdb::DB *dst)
+{
+    long copied = 0;
+    rocksdb::WriteBatch batch;
+    std::unique_ptr<rocksdb::Iterator> it(src->NewIterator(rocksdb::ReadOptions()));
+    for (it->SeekToFirst(); it->Valid(); it->Next())
+    {
+        int32_t key;
+        if (!parse_legacy_key(it->key(), key))
+        {
+            fmt::print(stderr, "Skipping the key \"{}\", it is not a legacy key\n", it->key().ToString());
+            continue;
+        }
+        batch.Put(key_slice(encode_key(key)), it->value());
+        if (++copied % keys_per_batch == 0)
+        {
+            if (!dst->Write(rocksdb::WriteOptions(), &batch).ok())
+            {
+                return -1;
+            }
+            batch.Clear();
+        }
+    }
+    if (!it->status().ok() || !dst->Write(rocksdb::WriteOptions(), &batch).ok())
+    {
+        return -1;
+    }
+    return copied;
+}
+
+int main(int argc, char *argv[])
+{
+    /* This is parsing the command line arguments. */
+    cxxopts::Options options(argv[0], "Migrates a KV store of the server to the fixed-width key encoding");
+    options.allow_unrecognised_options().add_options()(
+        "d,db", "Directory of the RocksDB instance to migrate.",
+        cxxopts::value<std::string>())("h,help", "Print help");
+
+    auto args = options.parse(argc, argv);
+    if (args.count("help"))
+    {
+        fmt::print("{}\n", options.help());
+        return 0;
+    }
+
+    if (!args.count("db"))
+    {
+        fmt::print(stderr, "The database directory is required\n{}\n", options.help());
+        return 1;
+    }
+    std::string db_path = args["db"].as<std::string>();
+    std::string new_path = db_path + ".migrating";
+    std::string legacy_path = db_path + ".legacy";
+
+    /* The legacy database is only read, the new one is built next to it */
+    rocksdb::DB *src;
+    rocksdb::Options src_opts;
+    auto status = rocksdb::DB::OpenForReadOnly(src_opts, db_path, &src);
+    if (!status.ok())
+    {
+        fmt::print(stderr, "Cannot open {}: {}\n", db_path, status.ToString());
+        return 1;
+    }
+    int format = read_format(src);
+    if (format == current_format || format == 0)
+    {
+        fmt::print("{} is already in format {}\n", db_path, current_format);
+        delete src;
+        return 0;
+    }
+    if (format != legacy_format)
+    {
+        fmt::print(stderr, "The database at {} has format {}, which kv-migrate cannot read\n", db_path, format);
+        delete src;
+        return 1;
+    }
+
+    rocksdb::DB *dst;
+    rocksdb::Options dst_opts;
+    dst_opts.create_if_missing = true;
+    dst_opts.error_if_exists = true;
+    status = rocksdb::DB::Open(dst_opts, new_path, &dst);
+    if (!status.ok())
+    {
+        fmt::print(stderr, "Cannot create {}: {}\n", new_path, status.ToString());
+        delete src;
+        return 1;
+    }
+
+    long copied = copy_encoded(src, dst);
+    delete src;
+    if (copied < 0 || !write_format(dst, current_format).ok() || !dst->Flush(rocksdb::FlushOptions()).ok())
+    {
+        fmt::print(stderr, "Migrating {} failed, {} is incomplete\n", db_path, new_path);
+        delete dst;
+        return 1;
+    }
+    delete dst;
+
+    /* Swap the directories only once the new database is complete */
+    if (rename(db_path.c_str(), legacy_path.c_str()) < 0 || rename(new_path.c_str(), db_path.c_str()) < 0)
+    {
+        perror("Error swapping the database directories");
+        return 1;
+    }
+    fmt::print("Migrated {} keys of {}, the old database is kept at {}\n", copied, db_path, legacy_path);
+    return 0;
+}
@@ -21,14 +21,57 @@
 #include <google/protobuf/io/zero_copy_stream_impl.h>
 #include <google/protobuf/text_format.h>
 #include "rocksdb/db.h"
+#include "hash_ring.h"
+#include "migration.h"
+#include "placement.h"
+#include "range_table.h"
+#include <algorithm>
+#include <chrono>
+#include <csignal>
+#include <deque>
+#include <limits>
 #include <list>
+#include <map>
+#include <memory>
+#include <optional>
+#include <set>
+#include <utility>
+#include <vector>
+
+/* How the keys are placed on the servers */
+enum class Placement
+{
+    strategy, /* by a PlacementStrategy that hashes the keys: ring, jump or rendezvous */
+    range,    /* by the range table, whose ranges are split and merged by their load */
+};
+
+/* How often the ranges are checked for splits and merges */
+constexpr auto range_check_interval = std::chrono::seconds(4);
 
 const char *hostname = "localhost";
 std::list<int> cluster; /* This stores the port number of the shards */
-std::list<int> keys;    /* This stores the keys */
+Placement placement;
+std::unique_ptr<PlacementStrategy> strategy; /* The placement of the keys on the shards of cluster */
+std::string placement_name; /* of strategy */
+size_t vnodes;              /* of strategy, if it is the ring */
+std::map<int, uint32_t> weights; /* of the servers of cluster */
+RangeTable ranges;      /* The placement of the keys in range mode */
+std::unique_ptr<PlacementStrategy> previous_strategy; /* of the keys before the last change of strategy */
+RangeTable previous_ranges;                           /* of the keys before the last change of ranges */
+size_t bulk_min_keys;   /* Fewer keys of a page to one server do not go as an SST file */
+size_t migration_threads;    /* Threads that move keys at once */
+size_t migration_batch_keys; /* Keys per page of a migration */
+size_t range_split_keys; /* A range with more keys is split; 0 never splits by size */
+size_t range_split_qps;  /* A range with more requests per second is split; 0 never splits by load */
 
-std::atomic<int64_t> number{0};
+ServerConnections connections;        /* Of the master thread to the servers */
+int notify_pipe[2];                   /* The migration threads wake up the master loop through it */
+std::unique_ptr<Migration> migration; /* The moves of the last change of the placement, while they run */
+std::deque<sockets::master_msg> pending_joins; /* Joins that wait for the migration to end */
+std::vector<std::pair<int, int>> parked;       /* Lookups, by client fd and key, of keys in flight */
+uint64_t map_version; /* of the shard map the servers know, see publish_map() */
 
+std::atomic<int64_t> number{0};
 
 /**
  * It prints an error message and exits the program
@@ -41,21 +84,526 @@ void error(const char *msg)
     exit(0);
 }
 
+/**
+ * It returns the port of the server responsible for key; the cluster must not be empty.
+ */
 int find_shard(int key)
 {
-    int num_servers = cluster.size();
-    int shard_id = (key % num_servers) + 1;
+    if (placement == Placement::range)
+    {
+        return ranges.owner(key);
+    }
+    return strategy->owner(key);
+}
+
+/**
+ * It sends the framed response on fd.
+ *
+ * @param buffer The send buffer, reused from one response to the next.
+ */
+void send_response(int fd, const sockets::master_msg &response, std::string &buffer)
+{
+    buffer.clear();
+    append_serialized(buffer, response);
+    secure_send(fd, buffer.data(), buffer.size());
+}
+
+/**
+ * It answers the CLIENT_LOCATE on fd with the server at port and closes fd.
+ */
+void send_location(int fd, int port, sockets::master_msg &response, std::string &buffer)
+{
+    response.Clear();
+    response.set_operation(sockets::master_msg::RESPONSE_LOCATE);
+    response.set_port(port);
+    send_response(fd, response, buffer);
+    close(fd);
+}
+
+/**
+ * It describes the shard map for a client: the servers and the placement of
+ * the keys on them. While keys move the placement is not final, and the
+ * client locates every key with CLIENT_LOCATE instead.
+ */
+void describe_map(sockets::master_msg::ShardMap &map)
+{
+    map.set_version(map_version);
+    map.set_migrating(migration != nullptr);
+    map.set_placement(placement_name);
+    map.set_vnodes(vnodes);
+    for (int port : cluster)
+    {
+        map.add_servers(port);
+        map.add_weights(weights[port]);
+    }
+    for (size_t i = 0; placement == Placement::range && i < ranges.size(); i++)
+    {
+        auto *range = map.add_ranges();
+        range->set_start(ranges[i].start);
+        range->set_end(ranges[i].end);
+        range->set_server(ranges[i].server);
+    }
+}
+
+/**
+ * It gives the shard map a new version and tells every server, which from
+ * then on rejects the requests that clients routed by an older copy. The
+ * clients then fetch the map again, so it is published before any key moves
+ * and once they all moved. Binary requests carry the low 32 bits of the
+ * version, which are never 0. A server that does not answer is skipped: it
+ * keeps rejecting the requests of any newer map until it learns this
+ * version, and a restarted one learns it when it joins again.
+ */
+void publish_map()
+{
+    do
+    {
+        ++map_version;
+    } while (static_cast<uint32_t>(map_version) == 0);
+    server::server_msg request;
+    server::server_msg response;
+    request.set_operation(server::server_msg::MAP_VERSION);
+    request.set_key(0);
+    request.set_map_version(map_version);
+    for (size_t i = 0; placement == Placement::range && i < ranges.size(); i++)
+    {
+        request.add_range_starts(ranges[i].start);
+    }
+    for (int port : cluster)
+    {
+        if (!connections.ask(port, request, response) || !response.success())
+        {
+            fmt::print(stderr, "Could not publish version {} of the shard map to the server at {}\n", map_version, port);
+        }
+    }
+}
+
+/**
+ * It describes the placement strategy over the servers at ports to a
+ * server, which tells from it which of its keys leave it.
+ */
+server::server_msg::Slice slice_of(const std::list<int> &ports)
+{
+    server::server_msg::Slice slice;
+    slice.set_placement(placement_name);
+    slice.set_vnodes(vnodes);
+    for (int port : ports)
+    {
+        slice.add_servers(port);
+        slice.add_weights(weights[port]);
+    }
+    return slice;
+}
+
+/**
+ * It keeps a copy of the placement before it changes, which tells where a
+ * key was before the migration that follows.
+ */
+void keep_previous_placement()
+{
+    if (placement == Placement::range)
+    {
+        previous_ranges = ranges;
+        return;
+    }
+    previous_strategy = strategy->clone();
+}
+
+/**
+ * It returns the port of the server a key is on: while keys move, the one
+ * it had before the change of the placement until its move got to it.
+ *
+ * @return nothing while the key is in flight
+ */
+std::optional<int> locate_key(int key)
+{
+    int owner = find_shard(key);
+    if (migration == nullptr)
+    {
+        return owner;
+    }
+    int previous_owner = owner;
+    if (placement == Placement::range && !previous_ranges.empty())
+    {
+        previous_owner = previous_ranges.owner(key);
+    }
+    else if (placement == Placement::strategy && !previous_strategy->empty())
+    {
+        previous_owner = previous_strategy->owner(key);
+    }
+    if (previous_owner == owner)
+    {
+        return owner;
+    }
+    switch (migration->locate(key, previous_owner))
+    {
+    case Migration::KeyState::pending:
+        return previous_owner;
+    case Migration::KeyState::in_flight:
+        return std::nullopt;
+    default:
+        return owner;
+    }
+}
+
+/**
+ * It settles the keys a joining server kept in its data directory. A held
+ * key of the server's own shard stays where it is. A held key of another
+ * shard is a stale copy if that shard has the key, as it has the live
+ * value, and is deleted; otherwise it is moved there. Lookups of a held
+ * key go to its shard all along.
+ *
+ * @param moves where to add the moves of the held keys
+ */
+void place_held_keys(int port, std::vector<KeyMove> &moves)
+{
+    if (placement == Placement::strategy)
+    {
+        moves.push_back({port, std::numeric_limits<int32_t>::min(), std::numeric_limits<int32_t>::max(), slice_of(cluster), 0, true});
+        return;
+    }
+    for (size_t i = 0; i < ranges.size(); i++)
+    {
+        if (ranges[i].server != port)
+        {
+            moves.push_back({port, ranges[i].start, ranges[i].end, std::nullopt, ranges[i].server, true});
+        }
+    }
+}
+
+/**
+ * It adds the server at join_port to the placement strategy. The keys it
+ * takes over leave every server, which tells them from the grown placement.
+ * Some strategies also move keys between the old servers, e.g. rendezvous
+ * when the new server outweighs them.
+ *
+ * @param weight the relative capacity of the server
+ * @param moves where to add the moves of the keys that change server
+ */
+void join_strategy(int join_port, uint32_t weight, std::vector<KeyMove> &moves)
+{
+    weights[join_port] = weight;
+    auto grown = cluster;
+    grown.push_back(join_port);
+    auto slice = slice_of(grown);
+    for (int port : cluster)
+    {
+        moves.push_back({port, std::numeric_limits<int32_t>::min(), std::numeric_limits<int32_t>::max(), slice});
+    }
+    strategy->add(join_port, weight);
+}
+
+/* The keys of a range of the range table, as counted by its server */
+struct RangeLoad
+{
+    uint64_t nb_keys;
+    int median_key;       /* if nb_keys > 0 */
+    uint64_t nb_requests; /* that clients routed to the range since the last count */
+};
+
+/**
+ * It asks the server of every range for the number of keys and requests of
+ * the range. A server that does not answer is skipped: its ranges have no
+ * load until the next check.
+ */
+std::vector<std::optional<RangeLoad>> range_loads()
+{
+    std::vector<std::optional<RangeLoad>> loads;
+    std::set<int> unreachable;
+    server::server_msg request;
+    server::server_msg response;
+    request.set_operation(server::server_msg::KEY_COUNT);
+    for (size_t i = 0; i < ranges.size(); i++)
+    {
+        request.set_key(ranges[i].start);
+        request.set_end_key(ranges[i].end);
+        if (unreachable.count(ranges[i].server) || !connections.ask(ranges[i].server, request, response) || !response.success())
+        {
+            if (unreachable.insert(ranges[i].server).second)
+            {
+                fmt::print(stderr, "Could not count the keys of the ranges of the server at {}\n", ranges[i].server);
+            }
+            loads.emplace_back();
+            continue;
+        }
+        loads.push_back(RangeLoad{response.nb_keys(), response.median_key(), response.nb_requests()});
+    }
+    return loads;
+}
+
+/**
+ * It chooses where to split range: at the median of its keys, so that both
+ * parts get half of them, or in its middle if it has fewer than two.
+ *
+ * @return nothing if the range is a single key
+ */
+std::optional<int> split_point(const KeyRange &range, const RangeLoad &load)
+{
+    if (load.nb_keys >= 2)
+    {
+        return load.median_key;
+    }
+    if (range.start == range.end)
+    {
+        return std::nullopt;
+    }
+    return static_cast<int>(range.start + (static_cast<int64_t>(range.end) - range.start + 1) / 2);
+}
+
+/**
+ * It splits range i before at and gives the upper part to the server at
+ * to_port, which the keys of that part move to.
+ *
+ * @param moves where to add the move of the keys of the upper part
+ */
+void split_range(size_t i, int at, int to_port, std::vector<KeyMove> &moves)
+{
+    int from_port = ranges[i].server;
+    if (from_port != to_port)
+    {
+        moves.push_back({from_port, at, ranges[i].end, std::nullopt, to_port});
+    }
+    ranges.split(i, at, to_port);
+}
+
+/**
+ * It gives the server at join_port the upper half of the range with the
+ * most keys, or of the widest range while there are no keys. The ranges of
+ * a server that does not answer are left out; without any other range the
+ * server joins without one, and takes one at a later split.
+ *
+ * @param moves where to add the move of the keys of that half
+ */
+void join_ranges(int join_port, std::vector<KeyMove> &moves)
+{
+    if (ranges.empty())
+    {
+        ranges.assign_all(join_port);
+        return;
+    }
+    auto loads = range_loads();
+    auto width = [](const KeyRange &range)
+    { return static_cast<int64_t>(range.end) - range.start; };
+    std::optional<size_t> largest;
+    for (size_t i = 0; i < ranges.size(); i++)
+    {
+        if (loads[i] && (!largest || std::make_pair(loads[i]->nb_keys, width(ranges[i])) >
+                                         std::make_pair(loads[*largest]->nb_keys, width(ranges[*largest]))))
+        {
+            largest = i;
+        }
+    }
+    if (!largest)
+    {
+        fmt::print(stderr, "No range to give to the server at {}\n", join_port);
+        return;
+    }
+    if (auto at = split_point(ranges[*largest], *loads[*largest]))
+    {
+        split_range(*largest, *at, join_port, moves);
+    }
+}
+
+/**
+ * It returns the server, other than except, with the fewest keys in its
+ * ranges, leaving out the servers whose ranges have no load.
+ *
+ * @return nothing if there is no such server
+ */
+std::optional<int> least_loaded(const std::vector<std::optional<RangeLoad>> &loads, int except)
+{
+    std::map<int, uint64_t> load;
+    for (int port : cluster)
+    {
+        if (port != except)
+        {
+            load[port] = 0;
+        }
+    }
+    for (size_t i = 0; i < ranges.size(); i++)
+    {
+        if (auto it = load.find(ranges[i].server); it != load.end())
+        {
+            if (!loads[i])
+            {
+                load.erase(it);
+                continue;
+            }
+            it->second += loads[i]->nb_keys;
+        }
+    }
+    if (load.empty())
+    {
+        return std::nullopt;
+    }
+    return std::min_element(load.begin(), load.end(), [](auto const &lhs, auto const &rhs)
+                            { return lhs.second < rhs.second; })
+        ->first;
+}
+
+/**
+ * It rebalances the range table by the load of the last elapsed seconds.
+ * A range above range_split_keys keys or range_split_qps requests per
+ * second is split at its median key, and its upper half goes to the least
+ * loaded other server; one range is split per check, since a split moves
+ * keys. Without a split, neighbouring ranges that together stay below a
+ * quarter of both thresholds are merged, onto the server of the one with
+ * more keys, unless that would leave the other server without a range.
+ * A key moves once, from its server before the check, so the check stops
+ * after the first merge that moves keys. The ranges of a server that does
+ * not answer are neither split nor merged.
+ *
+ * @param moves where to add the moves of the keys that change server
+ */
+void check_ranges(double elapsed, std::vector<KeyMove> &moves)
+{
+    auto loads = range_loads();
+    auto qps = [&loads, elapsed](size_t i)
+    { return static_cast<double>(loads[i]->nb_requests) / elapsed; };
+    auto above = [](double load, size_t threshold, size_t divisor)
+    { return threshold > 0 && load > static_cast<double>(threshold) / divisor; };
+    for (size_t i = ranges.size(); cluster.size() > 1 && i-- > 0;)
+    {
+        if (!loads[i] || (!above(loads[i]->nb_keys, range_split_keys, 1) && !above(qps(i), range_split_qps, 1)))
+        {
+            continue;
+        }
+        auto at = split_point(ranges[i], *loads[i]);
+        auto to_port = least_loaded(loads, ranges[i].server);
+        if (at && to_port)
+        {
+            split_range(i, *at, *to_port, moves);
+            return;
+        }
+    }
+    for (size_t i = ranges.size() - 1; i-- > 0;)
+    {
+        if (!loads[i] || !loads[i + 1])
+        {
+            continue;
+        }
+        auto nb_keys = loads[i]->nb_keys + loads[i + 1]->nb_keys;
+        auto load = qps(i) + qps(i + 1);
+        if (above(nb_keys, range_split_keys, 4) || above(load, range_split_qps, 4))
+        {
+            continue;
+        }
+        bool lower_larger = loads[i]->nb_keys >= loads[i + 1]->nb_keys;
+        int to_port = ranges[lower_larger ? i : i + 1].server;
+        int from_port = ranges[lower_larger ? i + 1 : i].server;
+        if (from_port != to_port)
+        {
+            /* Every server keeps a range */
+            if (ranges.count(from_port) == 1)
+            {
+                continue;
+            }
+            auto const &moved = ranges[lower_larger ? i + 1 : i];
+            moves.push_back({from_port, moved.start, moved.end, std::nullopt, to_port});
+            ranges.merge(i, to_port);
+            break;
+        }
+        ranges.merge(i, to_port);
+        loads[i]->nb_keys = nb_keys;
+        loads[i]->nb_requests += loads[i + 1]->nb_requests;
+        loads.erase(loads.begin() + i + 1);
+    }
+}
+
+/**
+ * It publishes the changed placement and starts moving the keys of moves in
+ * the background.
+ */
+void start_migration(const std::vector<KeyMove> &moves)
+{
+    publish_map();
+    migration = std::make_unique<Migration>(moves, Migration::Options{migration_threads, migration_batch_keys, bulk_min_keys}, notify_pipe[1]);
+}
 
-    return shard_id;
+/**
+ * It adds the server of a SERVER_JOIN to the placement and starts moving the
+ * keys that change server.
+ */
+void handle_join(const sockets::master_msg &request)
+{
+    /* A server that restarts at its old port keeps its place and its keys */
+    int join_port = request.server_port();
+    bool rejoin = std::find(cluster.begin(), cluster.end(), join_port) != cluster.end();
+    std::vector<KeyMove> moves;
+    keep_previous_placement();
+    /* There is a need for redistribution */
+    if (!rejoin)
+    {
+        if (placement == Placement::range)
+        {
+            join_ranges(join_port, moves);
+        }
+        else
+        {
+            join_strategy(join_port, std::max<uint32_t>(request.weight(), 1), moves);
+        }
+        cluster.push_back(join_port);
+    }
+    place_held_keys(join_port, moves);
+    start_migration(moves);
+}
+
+/**
+ * It answers the parked lookups whose keys are no longer in flight. Once
+ * every key moved it ends the migration and starts the next waiting join.
+ */
+void advance_migration(sockets::master_msg &response, std::string &buffer)
+{
+    while (migration != nullptr)
+    {
+        for (auto it = parked.begin(); it != parked.end();)
+        {
+            auto server_port = locate_key(it->second);
+            if (!server_port)
+            {
+                ++it;
+                continue;
+            }
+            send_location(it->first, *server_port, response, buffer);
+            it = parked.erase(it);
+        }
+        if (!migration->done())
+        {
+            return;
+        }
+        migration.reset();
+        publish_map();
+        if (pending_joins.empty())
+        {
+            return;
+        }
+        handle_join(pending_joins.front());
+        pending_joins.pop_front();
+    }
 }
 
+
 int main(int argc, char *argv[])
 {
     /* This is parsing the command line arguments. */
     cxxopts::Options options(argv[0], "Sever for the sockets benchmark");
     options.allow_unrecognised_options().add_options()(
         "p,port", "Port at which the master listens to.",
-        cxxopts::value<size_t>())("h,help", "Print help");
+        cxxopts::value<size_t>())(
+        "placement", fmt::format("How the keys are placed on the servers: by hashing them with one of {}, or range, by a table of key ranges that are split and merged by their load.", placement_names),
+        cxxopts::value<std::string>()->default_value(std::string(default_placement)))(
+        "range-split-keys", "In range placement, split a range once it holds more keys; 0 never splits by size.",
+        cxxopts::value<size_t>()->default_value("100000"))(
+        "range-split-qps", "In range placement, split a range once its keys are requested more often per second; 0 never splits by load.",
+        cxxopts::value<size_t>()->default_value("1000"))(
+        "vnodes", "Number of points of every server, per unit of weight, on the consistent-hash ring of the ring placement.",
+        cxxopts::value<size_t>()->default_value(std::to_string(HashRing::default_vnodes)))(
+        "bulk-min-keys", "Move the keys of a page of a migration from one server to another as one SST file once they are this many; fewer go as one MULTI_GET and one MULTI_PUT.",
+        cxxopts::value<size_t>()->default_value("64"))(
+        "migration-threads", "Number of threads that move keys between servers while the master keeps serving lookups, each through a part of the keys of every server they leave.",
+        cxxopts::value<size_t>()->default_value("4"))(
+        "migration-batch-keys", "Number of keys per page of a migration, which a server lists and moves at once.",
+        cxxopts::value<size_t>()->default_value("4096"))("h,help", "Print help");
 
     auto args = options.parse(argc, argv);
     if (args.count("help"))
@@ -73,6 +621,22 @@ int main(int argc, char *argv[])
 
     /* This is converting the arguments into integers. */
     int port = args["port"].as<size_t>();
+    bulk_min_keys = std::max<size_t>(args["bulk-min-keys"].as<size_t>(), 1);
+    migration_threads = std::max<size_t>(args["migration-threads"].as<size_t>(), 1);
+    migration_batch_keys = std::max<size_t>(args["migration-batch-keys"].as<size_t>(), 1);
+    placement_name = args["placement"].as<std::string>();
+    vnodes = args["vnodes"].as<size_t>();
+    placement = placement_name == "range" ? Placement::range : Placement::strategy;
+    strategy = make_placement(placement_name, vnodes);
+    if (placement == Placement::strategy && strategy == nullptr)
+    {
+        fmt::print(stderr, "Unknown placement {}, expected one of {}, range\n", placement_name, placement_names);
+        return 1;
+    }
+    range_split_keys = args["range-split-keys"].as<size_t>();
+    range_split_qps = args["range-split-qps"].as<size_t>();
+    /* The versions of a restarted master are newer than the ones clients may have cached from before */
+    map_version = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
 
     /* This is creating a socket and checking if it is valid. */
     int sockfd = listening_socket(port);
@@ -81,21 +645,51 @@ int main(int argc, char *argv[])
         error("Error creating socket");
     }
 
+    /* A server that goes away closes a connection of the migration, which must not kill the master */
+    signal(SIGPIPE, SIG_IGN);
+    if (pipe(notify_pipe) < 0 || set_nonblocking(notify_pipe[0]) < 0 || set_nonblocking(notify_pipe[1]) < 0)
+    {
+        error("Error creating the notification pipe");
+    }
+
     fd_set current_sockets, ready_sockets;
     FD_ZERO(&current_sockets);
     FD_SET(sockfd, &current_sockets);
+    FD_SET(notify_pipe[0], &current_sockets);
 
     struct timeval tv;
-    tv.tv_sec = 4;
-    tv.tv_usec = 0;
+    auto last_range_check = std::chrono::steady_clock::now();
+
+    /* The messages are cleared and reused for every request, which keeps the memory of their fields */
+    sockets::master_msg request;
+    sockets::master_msg response;
+    std::string response_message;
 
     while (true)
     {
         ready_sockets = current_sockets;
-        if (select(FD_SETSIZE, &ready_sockets, NULL, NULL, NULL) < 0)
+        /* In range placement the loop wakes up for the checks of the ranges */
+        tv.tv_sec = range_check_interval.count();
+        tv.tv_usec = 0;
+        if (select(FD_SETSIZE, &ready_sockets, NULL, NULL, placement == Placement::range ? &tv : NULL) < 0)
         {
             error("Error in select");
         }
+        auto now = std::chrono::steady_clock::now();
+        /* The ranges are checked between migrations */
+        if (placement == Placement::range && migration == nullptr && !ranges.empty() && now - last_range_check >= range_check_interval)
+        {
+            std::vector<KeyMove> moves;
+            /* Every split or merge changes the number of ranges */
+            size_t nb_ranges = ranges.size();
+            keep_previous_placement();
+            check_ranges(std::chrono::duration<double>(now - last_range_check).count(), moves);
+            if (ranges.size() != nb_ranges)
+            {
+                start_migration(moves);
+            }
+            last_range_check = now;
+        }
         for (int i = 0; i < FD_SETSIZE; i++)
         {
             if (FD_ISSET(i, &ready_sockets))
@@ -110,6 +704,14 @@ int main(int argc, char *argv[])
                     }
                     FD_SET(newsockfd, &current_sockets);
                 }
+                else if (i == notify_pipe[0])
+                {
+                    /* The progress of the migration is checked below */
+                    char drain[64];
+                    while (read(i, drain, sizeof(drain)) > 0)
+                    {
+                    }
+                }
                 else
                 {
                     /* This is reading the message. */
@@ -122,90 +724,21 @@ int main(int argc, char *argv[])
                     {
                         return 1;
                     }
-                    /* Parsing the message from the buffer */
-                    sockets::master_msg request;
-                    auto size = bytecount;
-                    std::string master_message(buffer.get(), size);
-                    request.ParseFromString(master_message);
+                    /* Parsing the message straight from the buffer */
+                    request.ParseFromArray(buffer.get(), bytecount);
+                    response.Clear();
                     /* This is handling the message. */
                     if (request.operation() == sockets::master_msg::SERVER_JOIN)
                     {
-                        /* There is a need for redistribution */
-                        if (cluster.size() > 0)
+                        /* One migration at a time: the placement must not change under it */
+                        if (migration != nullptr)
+                        {
+                            pending_joins.push_back(request);
+                        }
+                        else
                         {
-                            for (auto key : keys)
-                            {
-                                int shard_id = find_shard(key);
-                                auto cluster_front = cluster.begin();
-                                std::advance(cluster_front, shard_id - 1);
-                                int server_port = *cluster_front;
-                                int serverfd = connect_socket(hostname, server_port);
-                                if (serverfd < 0)
-                                {
-                                    error("Error connecting to server");
-                                }
-                                /* Get the value of key from server */
-                                server::server_msg server_msg;
-                                server_msg.set_operation(server::server_msg::GET);
-                                server_msg.set_key(key);
-                                /* Send the proto message */
-                                std::string server_str;
-                                server_msg.SerializeToString(&server_str);
-                                auto msg_size = server_str.size();
-                                auto buf = std::make_unique<char[]>(msg_size + length_size_field);
-                                construct_message(buf.get(), server_str.c_str(), msg_size);
-                                secure_send(serverfd, buf.get(), msg_size + length_size_field);
-                                /* Receive the response from the server */
-                                auto [bytecount, buffer] = secure_recv(serverfd);
-                                if (bytecount <= 0)
-                                {
-                                    return 1;
-                                }
-
-                                if (buffer == nullptr || bytecount == 0)
-                                {
-                                    return 1;
-                                }
-                                /* Parsing the message from the buffer */
-                                server::server_msg response;
-                                auto size = bytecount;
-                                std::string response_message(buffer.get(), size);
-                                response.ParseFromString(response_message);
-                                std::string value = response.value();
-                                /* Send delete request to the server */
-                                serverfd = connect_socket(hostname, server_port);
-                                server_msg.set_operation(server::server_msg::DELETE);
-                                server_msg.set_key(key);
-                                /* Send the proto message */
-                                server_str.clear();
-                                server_msg.SerializeToString(&server_str);
-                                msg_size = server_str.size();
-                                buf = std::make_unique<char[]>(msg_size + length_size_field);
-                                construct_message(buf.get(), server_str.c_str(), msg_size);
-                                secure_send(serverfd, buf.get(), msg_size + length_size_field);
-
-                                /* Send put request to the correct server */
-                                cluster.push_back(request.server_port());
-                                shard_id = find_shard(key);
-                                cluster_front = cluster.begin();
-                                std::advance(cluster_front, shard_id - 1);
-                                server_port = *cluster_front;
-                                serverfd = connect_socket(hostname, server_port);
-                                cluster.pop_back();
-                                server_msg.set_operation(server::server_msg::PUT);
-                                server_msg.set_key(key);
-                                server_msg.set_value(value);
-                                /* Send the proto message */
-                                server_str.clear();
-                                server_msg.SerializeToString(&server_str);
-                                msg_size = server_str.size();
-                                buf = std::make_unique<char[]>(msg_size + length_size_field);
-                                construct_message(buf.get(), server_str.c_str(), msg_size);
-                                secure_send(serverfd, buf.get(), msg_size + length_size_field);
-                            }
+                            handle_join(request);
                         }
-                        cluster.push_back(request.server_port());
-                        
                     }
                     else if (request.operation() == sockets::master_msg::CLIENT_LOCATE)
                     {
@@ -213,27 +746,35 @@ int main(int argc, char *argv[])
                         {
                             return 1;
                         }
-                        int shard_id = find_shard(request.key());
-                        keys.push_back(request.key());
-
-                        auto cluster_front = cluster.begin();
-                        std::advance(cluster_front, shard_id - 1);
-                        int server_port = *cluster_front;
-                        
-                        sockets::master_msg response;
-                        response.set_operation(sockets::master_msg::RESPONSE_LOCATE);
-                        response.set_port(server_port);
-                        std::string response_message;
-                        response.SerializeToString(&response_message);
-                        auto response_size = response_message.size();
-                        auto response_buffer = std::make_unique<char[]>(response_size + length_size_field);
-                        construct_message(response_buffer.get(), response_message.c_str(), response_size);
-                        secure_send(i, response_buffer.get(), response_size + length_size_field);
+                        /* A moving key is wherever its page left it */
+                        auto server_port = locate_key(request.key());
+                        FD_CLR(i, &current_sockets);
+                        if (!server_port)
+                        {
+                            parked.emplace_back(i, request.key());
+                            continue;
+                        }
+                        send_location(i, *server_port, response, response_message);
+                        continue;
+                    }
+                    else if (request.operation() == sockets::master_msg::CLIENT_MAP)
+                    {
+                        response.set_operation(sockets::master_msg::RESPONSE_MAP);
+                        describe_map(*response.mutable_map());
+                        send_response(i, response, response_message);
+                    }
+                    else if (request.operation() == sockets::master_msg::CLIENT_LIST)
+                    {
+                        response.set_operation(sockets::master_msg::RESPONSE_LIST);
+                        response.mutable_ports()->Add(cluster.begin(), cluster.end());
+                        send_response(i, response, response_message);
                     }
                     FD_CLR(i, &current_sockets);
+                    close(i);
                 }
             }
         }
+        advance_migration(response, response_message);
     }
 
     /* Closing the sockets. */
@@ -0,0 +1,450 @@
+#include <algorithm>
+#include <bit>
+#include <cstring>
+#include <mutex>
+#include <optional>
+
+#include "memory_engine.h"
+
+#include "counter_merge.h"
+#include "value_ttl.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+namespace {
+
+constexpr int8_t ctrl_empty = -128;
+constexpr int8_t ctrl_deleted = -2;
+/* Keys of the first pass of a scan; every further pass takes twice as many. */
+constexpr size_t scan_first_pass_keys = 256;
+
+auto hash_key(uint32_t key) -> uint64_t {
+  auto hash = key * 0x9E3779B97F4A7C15ULL;
+  return hash ^ (hash >> 29);
+}
+
+/* The 7 bits of the hash kept in the control byte of a full slot. */
+auto h2(uint64_t hash) -> int8_t { return static_cast<int8_t>(hash & 0x7F); }
+
+/* The control bytes of one probe group; each match is a bitmask of slots. */
+class Group {
+public:
+  explicit Group(const int8_t *ctrl) {
+#if defined(__SSE2__)
+    bytes = _mm_loadu_si128(reinterpret_cast<const __m128i *>(ctrl));
+#else
+    std::memcpy(bytes.data(), ctrl, bytes.size());
+#endif
+  }
+
+  [[nodiscard]] auto match(int8_t value) const -> uint32_t {
+#if defined(__SSE2__)
+    return static_cast<uint32_t>(
+        _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_set1_epi8(value), bytes)));
+#else
+    uint32_t bits = 0;
+    for (size_t i = 0; i < bytes.size(); ++i) {
+      bits |= static_cast<uint32_t>(bytes[i] == value) << i;
+    }
+    return bits;
+#endif
+  }
+
+  [[nodiscard]] auto match_empty() const -> uint32_t {
+    return match(ctrl_empty);
+  }
+
+  /* Empty and deleted are the only control bytes with the sign bit set. */
+  [[nodiscard]] auto match_free() const -> uint32_t {
+#if defined(__SSE2__)
+    return static_cast<uint32_t>(_mm_movemask_epi8(bytes));
+#else
+    uint32_t bits = 0;
+    for (size_t i = 0; i < bytes.size(); ++i) {
+      bits |= static_cast<uint32_t>(bytes[i] < 0) << i;
+    }
+    return bits;
+#endif
+  }
+
+private:
+#if defined(__SSE2__)
+  __m128i bytes;
+#else
+  std::array<int8_t, 16> bytes;
+#endif
+};
+
+/* It reads an encoded key, which is 4 bytes, as a uint32. */
+auto table_key(rocksdb::Slice key) -> std::optional<uint32_t> {
+  if (key.size() != sizeof(uint32_t)) {
+    return std::nullopt;
+  }
+  uint32_t value;
+  std::memcpy(&value, key.data(), sizeof(value));
+  return value;
+}
+
+auto invalid_key() -> rocksdb::Status {
+  return rocksdb::Status::InvalidArgument("keys of the memory engine are 4 bytes");
+}
+
+/* It collects the updates of a WriteBatch. */
+class Collector : public rocksdb::WriteBatch::Handler {
+public:
+  enum class Kind { put, remove, merge };
+
+  struct Update {
+    uint32_t key;
+    Kind kind;
+    rocksdb::Slice value; // the value, or the operand of a merge
+  };
+
+  auto PutCF(uint32_t /*column_family_id*/, const rocksdb::Slice &key,
+             const rocksdb::Slice &value) -> rocksdb::Status override {
+    return add(key, Kind::put, value);
+  }
+
+  auto DeleteCF(uint32_t /*column_family_id*/, const rocksdb::Slice &key)
+      -> rocksdb::Status override {
+    return add(key, Kind::remove, {});
+  }
+
+  auto MergeCF(uint32_t /*column_family_id*/, const rocksdb::Slice &key,
+               const rocksdb::Slice &value) -> rocksdb::Status override {
+    return add(key, Kind::merge, value);
+  }
+
+  std::vector<Update> updates;
+
+private:
+  auto add(rocksdb::Slice key, Kind kind, rocksdb::Slice value)
+      -> rocksdb::Status {
+    auto k = table_key(key);
+    if (!k) {
+      return invalid_key();
+    }
+    updates.push_back({*k, kind, value});
+    return rocksdb::Status::OK();
+  }
+};
+
+} // namespace
+
+auto Arena::allocate(size_t size) -> Block {
+  auto size_class =
+      std::max<unsigned>(min_class, std::bit_width(std::max<size_t>(size, 1) - 1));
+  auto capacity = size_t{1} << size_class;
+  auto &free_list = free_lists[size_class];
+  if (!free_list.empty()) {
+    auto *data = free_list.back();
+    free_list.pop_back();
+    return {data, static_cast<uint32_t>(capacity)};
+  }
+  /* Large values get a chunk of their own. */
+  if (capacity > chunk_size / 8) {
+    chunks.push_back(std::make_unique<char[]>(capacity));
+    return {chunks.back().get(), static_cast<uint32_t>(capacity)};
+  }
+  if (left < capacity) {
+    chunks.push_back(std::make_unique<char[]>(chunk_size));
+    cursor = chunks.back().get();
+    left = chunk_size;
+  }
+  auto *data = cursor;
+  cursor += capacity;
+  left -= capacity;
+  return {data, static_cast<uint32_t>(capacity)};
+}
+
+auto Arena::release(Block block) -> void {
+  free_lists[std::countr_zero(block.capacity)].push_back(block.data);
+}
+
+HashTable::HashTable() { resize(1); }
+
+auto HashTable::find(uint32_t key) -> Slot * {
+  auto hash = hash_key(key);
+  auto mask = nb_groups - 1;
+  auto group = (hash >> 7) & mask;
+  for (size_t step = 1;; ++step) {
+    Group controls(ctrl.get() + group * group_size);
+    for (auto bits = controls.match(h2(hash)); bits != 0; bits &= bits - 1) {
+      auto pos = group * group_size + std::countr_zero(bits);
+      if (slots[pos].key == key) {
+        return &slots[pos];
+      }
+    }
+    if (controls.match_empty() != 0) {
+      return nullptr;
+    }
+    group = (group + step) & mask;
+  }
+}
+
+auto HashTable::probe_free(uint64_t hash) -> size_t {
+  auto mask = nb_groups - 1;
+  auto group = (hash >> 7) & mask;
+  for (size_t step = 1;; ++step) {
+    auto bits = Group(ctrl.get() + group * group_size).match_free();
+    if (bits != 0) {
+      return group * group_size + std::countr_zero(bits);
+    }
+    group = (group + step) & mask;
+  }
+}
+
+auto HashTable::insert(uint32_t key) -> std::pair<Slot *, bool> {
+  if (auto *slot = find(key); slot != nullptr) {
+    return {slot, false};
+  }
+  if (growth_left == 0) {
+    /* Mostly deleted slots are reclaimed in place, otherwise it grows. */
+    resize(size + 1 > capacity() * 7 / 16 ? nb_groups * 2 : nb_groups);
+  }
+  auto hash = hash_key(key);
+  auto pos = probe_free(hash);
+  if (ctrl[pos] == ctrl_empty) {
+    --growth_left;
+  }
+  ctrl[pos] = h2(hash);
+  slots[pos] = Slot{key, 0, {nullptr, 0}};
+  ++size;
+  return {&slots[pos], true};
+}
+
+auto HashTable::erase(Slot *slot) -> void {
+  auto pos = static_cast<size_t>(slot - slots.get());
+  /* A probe stops at a group with an empty slot, so none passes this one. */
+  auto group = pos - pos % group_size;
+  if (Group(ctrl.get() + group).match_empty() != 0) {
+    ctrl[pos] = ctrl_empty;
+    ++growth_left;
+  } else {
+    ctrl[pos] = ctrl_deleted;
+  }
+  --size;
+}
+
+auto HashTable::resize(size_t new_groups) -> void {
+  auto old_ctrl = std::move(ctrl);
+  auto old_slots = std::move(slots);
+  auto old_capacity = capacity();
+  nb_groups = new_groups;
+  ctrl = std::make_unique<int8_t[]>(capacity());
+  std::fill_n(ctrl.get(), capacity(), ctrl_empty);
+  slots = std::make_unique<Slot[]>(capacity());
+  for (size_t i = 0; i < old_capacity; ++i) {
+    if (old_ctrl[i] >= 0) {
+      auto hash = hash_key(old_slots[i].key);
+      auto pos = probe_free(hash);
+      ctrl[pos] = h2(hash);
+      slots[pos] = old_slots[i];
+    }
+  }
+  growth_left = capacity() * 7 / 8 - size;
+}
+
+auto MemoryEngine::Shard::put(uint32_t key, rocksdb::Slice value) -> void {
+  if (table.full() && table.find(key) == nullptr) {
+    drop_expired();
+  }
+  auto [slot, inserted] = table.insert(key);
+  if (inserted || slot->value.capacity < value.size()) {
+    if (!inserted) {
+      arena.release(slot->value);
+    }
+    slot->value = arena.allocate(value.size());
+  }
+  std::memcpy(slot->value.data, value.data(), value.size());
+  slot->size = static_cast<uint32_t>(value.size());
+}
+
+auto MemoryEngine::Shard::remove(uint32_t key) -> void {
+  auto *slot = table.find(key);
+  if (slot != nullptr) {
+    arena.release(slot->value);
+    table.erase(slot);
+  }
+}
+
+auto MemoryEngine::Shard::merge(uint32_t key, rocksdb::Slice operand) -> void {
+  std::optional<rocksdb::Slice> existing;
+  if (auto *slot = table.find(key); slot != nullptr) {
+    existing.emplace(slot->value.data, slot->size);
+  }
+  put(key, merge_counter(existing ? &*existing : nullptr, {&operand, 1}));
+}
+
+auto MemoryEngine::Shard::drop_expired() -> void {
+  auto now = now_ms();
+  std::vector<uint32_t> expired;
+  table.for_each([&](HashTable::Slot const &slot) {
+    if (load_value(rocksdb::Slice(slot.value.data, slot.size)).expired(now)) {
+      expired.push_back(slot.key);
+    }
+  });
+  for (auto key : expired) {
+    remove(key);
+  }
+}
+
+auto MemoryEngine::shard(uint32_t key) -> Shard & {
+  static_assert(nb_shards == 16, "the shard is the top 4 bits of the hash");
+  return shards[hash_key(key) >> 60];
+}
+
+auto MemoryEngine::get(rocksdb::Slice key, rocksdb::PinnableSlice *value)
+    -> rocksdb::Status {
+  auto k = table_key(key);
+  if (!k) {
+    return invalid_key();
+  }
+  auto &s = shard(*k);
+  std::shared_lock l(s.lock);
+  auto *slot = s.table.find(*k);
+  if (slot == nullptr) {
+    return rocksdb::Status::NotFound();
+  }
+  /* The value may move once the lock is released, so it is copied. */
+  value->PinSelf(rocksdb::Slice(slot->value.data, slot->size));
+  return rocksdb::Status::OK();
+}
+
+auto MemoryEngine::multi_get(std::vector<rocksdb::Slice> const &keys,
+                             std::vector<std::string> *values)
+    -> std::vector<rocksdb::Status> {
+  std::vector<rocksdb::Status> statuses;
+  statuses.reserve(keys.size());
+  values->resize(keys.size());
+  for (size_t i = 0; i < keys.size(); ++i) {
+    rocksdb::PinnableSlice value(&(*values)[i]);
+    statuses.push_back(get(keys[i], &value));
+  }
+  return statuses;
+}
+
+auto MemoryEngine::put(rocksdb::Slice key, rocksdb::Slice value)
+    -> rocksdb::Status {
+  auto k = table_key(key);
+  if (!k) {
+    return invalid_key();
+  }
+  auto &s = shard(*k);
+  std::lock_guard l(s.lock);
+  s.put(*k, value);
+  return rocksdb::Status::OK();
+}
+
+auto MemoryEngine::remove(rocksdb::Slice key) -> rocksdb::Status {
+  auto k = table_key(key);
+  if (!k) {
+    return invalid_key();
+  }
+  auto &s = shard(*k);
+  std::lock_guard l(s.lock);
+  s.remove(*k);
+  return rocksdb::Status::OK();
+}
+
+auto MemoryEngine::merge(rocksdb::Slice key, rocksdb::Slice operand)
+    -> rocksdb::Status {
+  auto k = table_key(key);
+  if (!k) {
+    return invalid_key();
+  }
+  auto &s = shard(*k);
+  std::lock_guard l(s.lock);
+  s.merge(*k, operand);
+  return rocksdb::Status::OK();
+}
+
+auto MemoryEngine::write(rocksdb::WriteBatch *batch, bool /*sync*/)
+    -> rocksdb::Status {
+  Collector collector;
+  auto status = batch->Iterate(&collector);
+  if (!status.ok()) {
+    return status;
+  }
+  /* The batch is atomic: it holds the locks of all its shards, taken in
+     order, while it applies the updates. */
+  std::array<bool, nb_shards> touched{};
+  for (auto const &update : collector.updates) {
+    touched[static_cast<size_t>(&shard(update.key) - shards.data())] = true;
+  }
+  std::vector<std::unique_lock<std::shared_mutex>> locks;
+  for (size_t i = 0; i < nb_shards; ++i) {
+    if (touched[i]) {
+      locks.emplace_back(shards[i].lock);
+    }
+  }
+  for (auto const &update : collector.updates) {
+    auto &s = shard(update.key);
+    if (update.kind == Collector::Kind::put) {
+      s.put(update.key, update.value);
+    } else if (update.kind == Collector::Kind::remove) {
+      s.remove(update.key);
+    } else {
+      s.merge(update.key, update.value);
+    }
+  }
+  return rocksdb::Status::OK();
+}
+
+auto MemoryEngine::scan(rocksdb::Slice start, rocksdb::Slice end,
+                        ScanVisit const &visit) -> rocksdb::Status {
+  if (start.size() != sizeof(uint32_t) || end.size() != sizeof(uint32_t)) {
+    return invalid_key();
+  }
+  /* The table keys are the encoded bytes, so memcmp is the key order. */
+  auto before = [](uint32_t a, uint32_t b) {
+    return std::memcmp(&a, &b, sizeof(a)) < 0;
+  };
+  auto first = *table_key(start);
+  auto last = *table_key(end);
+  /* Each pass keeps the smallest keys after the ones visited so far in a
+     bounded heap, so a scan that visit stops early, like every SCAN that
+     resumes, does not sort the whole interval. */
+  std::vector<uint32_t> keys;
+  std::optional<uint32_t> visited_last;
+  rocksdb::PinnableSlice value;
+  for (size_t wanted = scan_first_pass_keys;; wanted *= 2) {
+    keys.clear();
+    for (auto &s : shards) {
+      std::shared_lock l(s.lock);
+      s.table.for_each([&](HashTable::Slot const &slot) {
+        if (before(slot.key, first) || before(last, slot.key) ||
+            (visited_last && !before(*visited_last, slot.key))) {
+          return;
+        }
+        if (keys.size() < wanted) {
+          keys.push_back(slot.key);
+          std::push_heap(keys.begin(), keys.end(), before);
+        } else if (before(slot.key, keys.front())) {
+          std::pop_heap(keys.begin(), keys.end(), before);
+          keys.back() = slot.key;
+          std::push_heap(keys.begin(), keys.end(), before);
+        }
+      });
+    }
+    std::sort_heap(keys.begin(), keys.end(), before);
+    for (auto key : keys) {
+      rocksdb::Slice key_bytes(reinterpret_cast<const char *>(&key),
+                               sizeof(key));
+      /* A key deleted since it was listed is skipped. */
+      if (get(key_bytes, &value).ok() && !visit(key_bytes, value)) {
+        return rocksdb::Status::OK();
+      }
+    }
+    if (keys.size() < wanted) {
+      return rocksdb::Status::OK();
+    }
+    visited_last = keys.back();
+  }
+}
+
+auto MemoryEngine::ingest(std::string const & /*path*/) -> rocksdb::Status {
+  return rocksdb::Status::NotSupported("the memory engine reads no SST files");
+}
@@ -0,0 +1,144 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <shared_mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "storage_engine.h"
+
+/**
+ ** Bump allocator of the values of one MemoryEngine shard.
+ **
+ ** A value gets a block of the next power of two of its size, carved out of
+ ** large chunks. A released block goes to the free list of its size and is
+ ** handed out again, so the memory of the arena is never returned until the
+ ** arena is destroyed. Not thread-safe.
+ **/
+class Arena {
+public:
+  struct Block {
+    char *data;
+    uint32_t capacity;
+  };
+
+  auto allocate(size_t size) -> Block;
+  auto release(Block block) -> void;
+
+private:
+  static constexpr size_t chunk_size = 1 << 20;
+  static constexpr unsigned min_class = 4; // blocks of at least 16 bytes
+
+  std::vector<std::unique_ptr<char[]>> chunks;
+  char *cursor{nullptr};
+  size_t left{0};
+  std::array<std::vector<char *>, 33> free_lists; // by log2 of capacity
+};
+
+/**
+ ** Open-addressing hash map from uint32 keys to values in an Arena, laid out
+ ** like a Swiss table.
+ **
+ ** Every slot has a control byte: empty, deleted, or the low 7 bits of the
+ ** hash of its key. Slots are probed in groups of 16, whose control bytes are
+ ** compared to the hash with one SSE2 comparison, so most lookups touch one
+ ** control group and one slot. The table grows at 7/8 load. Not thread-safe.
+ **/
+class HashTable {
+public:
+  struct Slot {
+    uint32_t key;
+    uint32_t size;
+    Arena::Block value;
+  };
+
+  HashTable();
+
+  auto find(uint32_t key) -> Slot *;
+
+  /**
+   ** It finds the slot of key, or claims one for it.
+   **
+   ** @return the slot, and true if it is new; a new slot has no value yet
+   **/
+  auto insert(uint32_t key) -> std::pair<Slot *, bool>;
+
+  auto erase(Slot *slot) -> void;
+
+  /* @return true if the next insert of a new key resizes the table */
+  [[nodiscard]] auto full() const -> bool { return growth_left == 0; }
+
+  template <typename Visit> auto for_each(Visit &&visit) const -> void {
+    for (size_t i = 0; i < capacity(); ++i) {
+      if (ctrl[i] >= 0) {
+        visit(slots[i]);
+      }
+    }
+  }
+
+private:
+  static constexpr size_t group_size = 16;
+
+  auto probe_free(uint64_t hash) -> size_t;
+  auto resize(size_t new_groups) -> void;
+  [[nodiscard]] auto capacity() const -> size_t {
+    return nb_groups * group_size;
+  }
+
+  std::unique_ptr<int8_t[]> ctrl;
+  std::unique_ptr<Slot[]> slots;
+  size_t nb_groups{0};
+  size_t size{0};
+  size_t growth_left{0}; // empty slots that may still be claimed
+};
+
+/**
+ ** The in-memory engine, for cache tiers that do not need durability: the
+ ** keys are spread over independently locked HashTable shards, each with
+ ** its own Arena. Nothing survives a restart and write() ignores sync.
+ ** There is no compaction to drop expired values: a shard drops them when
+ ** its table is about to grow.
+ **/
+class MemoryEngine : public StorageEngine {
+public:
+  auto get(rocksdb::Slice key, rocksdb::PinnableSlice *value)
+      -> rocksdb::Status override;
+  auto multi_get(std::vector<rocksdb::Slice> const &keys,
+                 std::vector<std::string> *values)
+      -> std::vector<rocksdb::Status> override;
+  auto put(rocksdb::Slice key, rocksdb::Slice value)
+      -> rocksdb::Status override;
+  auto remove(rocksdb::Slice key) -> rocksdb::Status override;
+  auto merge(rocksdb::Slice key, rocksdb::Slice operand)
+      -> rocksdb::Status override;
+  auto write(rocksdb::WriteBatch *batch, bool sync)
+      -> rocksdb::Status override;
+  /* The table has no order: it sorts the keys of the range in passes, each
+     of twice as many of the next smallest keys as the one before. */
+  auto scan(rocksdb::Slice start, rocksdb::Slice end, ScanVisit const &visit)
+      -> rocksdb::Status override;
+  /* Not supported: the engine has no reader of SST files. */
+  auto ingest(std::string const &path) -> rocksdb::Status override;
+
+private:
+  static constexpr size_t nb_shards = 16;
+
+  struct Shard {
+    std::shared_mutex lock;
+    HashTable table;
+    Arena arena;
+
+    auto put(uint32_t key, rocksdb::Slice value) -> void;
+    auto remove(uint32_t key) -> void;
+    auto merge(uint32_t key, rocksdb::Slice operand) -> void;
+    auto drop_expired() -> void;
+  };
+
+  auto shard(uint32_t key) -> Shard &;
+
+  std::array<Shard, nb_shards> shards;
+};
@@ -0,0 +1,409 @@
+#include <algorithm>
+#include <chrono>
+#include <map>
+#include <optional>
+#include <utility>
+
+#include "migration.h"
+
+#include <unistd.h>
+
+#include "shared.h"
+
+namespace {
+
+/* gethostbyname() of connect_socket() is not thread-safe */
+std::mutex connect_lock;
+
+/* Waits before a failed page is tried again, doubled after every failure */
+constexpr auto min_retry_backoff = std::chrono::milliseconds(100);
+constexpr auto max_retry_backoff = std::chrono::seconds(5);
+
+/**
+ ** It lists the keys of move from first to last on its source, at most
+ ** limit of them, 0 for no maximum.
+ **
+ ** @param keys where to add the keys
+ ** @param resume set to the key to list from next if the server stopped
+ ** early, reset otherwise
+ **/
+auto list_keys(ServerConnections &connections, KeyMove const &move,
+               int32_t first, int32_t last, uint32_t limit,
+               std::vector<int32_t> &keys, std::optional<int32_t> &resume)
+    -> bool {
+  server::server_msg request;
+  request.set_operation(server::server_msg::KEYS);
+  request.set_key(first);
+  request.set_end_key(last);
+  request.set_limit(limit);
+  request.set_peer_port(move.from);
+  if (move.slice) {
+    *request.mutable_slice() = *move.slice;
+  }
+  bool success = true;
+  resume.reset();
+  auto collect = [&](server::server_msg const &response) {
+    success = success && response.success();
+    for (auto const &entry : response.entries()) {
+      keys.push_back(entry.key());
+    }
+    if (response.has_resume_key()) {
+      resume = response.resume_key();
+    }
+  };
+  return connections.ask_all(move.from, request, collect) && success;
+}
+
+/**
+ ** It tells the source of move that its keys from first to last leave it.
+ ** It rejects the writes to them from then on, so that their clients wait
+ ** for the end of the move, and answers once it holds every write it
+ ** admitted before.
+ **/
+auto leave(ServerConnections &connections, KeyMove const &move, int32_t first,
+           int32_t last) -> bool {
+  server::server_msg request;
+  server::server_msg response;
+  request.set_operation(server::server_msg::LEAVE);
+  request.set_key(first);
+  request.set_end_key(last);
+  request.set_peer_port(move.from);
+  if (move.slice) {
+    *request.mutable_slice() = *move.slice;
+  }
+  return connections.ask(move.from, request, response) && response.success();
+}
+
+/**
+ ** It deletes the held keys that the server at to has, as it has their live
+ ** value, from the server at from, and leaves the others in keys.
+ **/
+auto drop_stale(ServerConnections &connections, int from, int to,
+                std::vector<int32_t> &keys) -> bool {
+  server::server_msg request;
+  server::server_msg response;
+  request.set_operation(server::server_msg::MULTI_GET);
+  request.set_key(keys.front());
+  for (auto key : keys) {
+    request.add_entries()->set_key(key);
+  }
+  if (!connections.ask(to, request, response) || !response.success()) {
+    return false;
+  }
+  std::string frames;
+  request.Clear();
+  request.set_operation(server::server_msg::DELETE);
+  keys.clear();
+  for (auto const &entry : response.entries()) {
+    if (entry.key_exists()) {
+      request.set_key(entry.key());
+      append_serialized(frames, request);
+    } else {
+      keys.push_back(entry.key());
+    }
+  }
+  return frames.empty() || connections.send(from, frames);
+}
+
+/* It moves keys as one SST file. */
+auto bulk_move(ServerConnections &connections, int from, int to,
+               std::vector<int32_t> const &keys) -> bool {
+  server::server_msg request;
+  server::server_msg response;
+  request.set_operation(server::server_msg::BOOTSTRAP_RECEIVE);
+  request.set_key(0);
+  if (!connections.ask(to, request, response) || !response.success()) {
+    return false;
+  }
+  request.set_operation(server::server_msg::BOOTSTRAP_SEND);
+  request.set_peer_port(response.peer_port());
+  for (auto key : keys) {
+    request.add_entries()->set_key(key);
+  }
+  return connections.ask(from, request, response) && response.success();
+}
+
+/**
+ ** It moves keys with one request to each server and the DELETEs in one
+ ** write. Expired and missing keys are only deleted; the others keep the
+ ** time they have left.
+ **/
+auto batch_move(ServerConnections &connections, int from, int to,
+                std::vector<int32_t> const &keys) -> bool {
+  server::server_msg request;
+  server::server_msg values;
+  request.set_operation(server::server_msg::MULTI_GET);
+  request.set_key(keys.front());
+  for (auto key : keys) {
+    request.add_entries()->set_key(key);
+  }
+  if (!connections.ask(from, request, values) || !values.success()) {
+    return false;
+  }
+  request.Clear();
+  request.set_operation(server::server_msg::MULTI_PUT);
+  for (auto &entry : *values.mutable_entries()) {
+    if (entry.key_exists()) {
+      entry.clear_key_exists();
+      request.add_entries()->Swap(&entry);
+    }
+  }
+  if (request.entries_size() > 0) {
+    server::server_msg response;
+    request.set_key(request.entries(0).key());
+    if (!connections.ask(to, request, response) || !response.success()) {
+      return false;
+    }
+  }
+  std::string frames;
+  request.Clear();
+  request.set_operation(server::server_msg::DELETE);
+  for (auto key : keys) {
+    request.set_key(key);
+    append_serialized(frames, request);
+  }
+  return connections.send(from, frames);
+}
+
+/* It wakes up the master, a full pipe already does */
+auto wake(int notify_fd) -> void {
+  char byte = 1;
+  [[maybe_unused]] auto written = write(notify_fd, &byte, sizeof(byte));
+}
+
+} // namespace
+
+ServerConnections::~ServerConnections() {
+  for (auto const &[port, fd] : fds) {
+    close(fd);
+  }
+}
+
+auto ServerConnections::connection(int port) -> int {
+  if (auto it = fds.find(port); it != fds.end()) {
+    return it->second;
+  }
+  int fd = -1;
+  {
+    std::lock_guard guard(connect_lock);
+    fd = connect_socket("localhost", port);
+  }
+  if (fd >= 0) {
+    fds.emplace(port, fd);
+  }
+  return fd;
+}
+
+auto ServerConnections::drop(int port) -> void {
+  if (auto it = fds.find(port); it != fds.end()) {
+    close(it->second);
+    fds.erase(it);
+  }
+}
+
+auto ServerConnections::ask(int port, server::server_msg const &request,
+                            server::server_msg &response) -> bool {
+  int fd = connection(port);
+  if (fd < 0) {
+    return false;
+  }
+  frame.clear();
+  append_serialized(frame, request);
+  if (!secure_send(fd, frame.data(), frame.size())) {
+    drop(port);
+    return false;
+  }
+  return receive(port, response);
+}
+
+auto ServerConnections::ask_all(
+    int port, server::server_msg const &request,
+    std::function<void(server::server_msg const &)> const &visit) -> bool {
+  server::server_msg response;
+  if (!ask(port, request, response)) {
+    return false;
+  }
+  visit(response);
+  while (response.more()) {
+    if (!receive(port, response)) {
+      return false;
+    }
+    visit(response);
+  }
+  return true;
+}
+
+auto ServerConnections::receive(int port, server::server_msg &response)
+    -> bool {
+  auto [bytecount, buffer] = secure_recv(fds.at(port));
+  if (bytecount == 0 || buffer == nullptr ||
+      !response.ParseFromArray(buffer.get(), static_cast<int>(bytecount))) {
+    drop(port);
+    return false;
+  }
+  return true;
+}
+
+auto ServerConnections::send(int port, std::string &frames) -> bool {
+  int fd = connection(port);
+  if (fd < 0) {
+    return false;
+  }
+  if (!secure_send(fd, frames.data(), frames.size())) {
+    drop(port);
+    return false;
+  }
+  return true;
+}
+
+Migration::Migration(std::vector<KeyMove> const &moves, Options options,
+                     int notify_fd)
+    : options(options), notify_fd(notify_fd) {
+  /* The parts of the moves take turns, so the threads spread over the
+     sources instead of all working on the first one */
+  auto nb_cuts = static_cast<int64_t>(std::max<size_t>(options.threads, 1));
+  for (int64_t cut = 0; cut < nb_cuts; ++cut) {
+    for (auto const &move : moves) {
+      auto width = static_cast<int64_t>(move.end) - move.start + 1;
+      auto start = move.start + width * cut / nb_cuts;
+      auto end = move.start + width * (cut + 1) / nb_cuts - 1;
+      if (start > end) {
+        continue;
+      }
+      Part part{move, nullptr, start, start};
+      part.move.start = static_cast<int32_t>(start);
+      part.move.end = static_cast<int32_t>(end);
+      if (move.slice) {
+        part.placement =
+            make_placement(move.slice->placement(), move.slice->vnodes(),
+                           move.slice->servers(), move.slice->weights());
+      }
+      parts.push_back(std::move(part));
+    }
+  }
+  auto nb_threads =
+      std::min(std::max<size_t>(options.threads, 1), parts.size());
+  for (size_t i = 0; i < nb_threads; ++i) {
+    threads.emplace_back([this] {
+      ServerConnections connections;
+      run(connections);
+    });
+  }
+}
+
+Migration::~Migration() {
+  for (auto &thread : threads) {
+    thread.join();
+  }
+}
+
+auto Migration::locate(int32_t key, int from) const -> KeyState {
+  std::lock_guard guard(lock);
+  for (auto const &part : parts) {
+    if (part.move.held || part.move.from != from || key < part.move.start ||
+        key > part.move.end) {
+      continue;
+    }
+    if (key < part.moved_end) {
+      return KeyState::moved;
+    }
+    return key < part.flight_end ? KeyState::in_flight : KeyState::pending;
+  }
+  return KeyState::moved;
+}
+
+auto Migration::done() const -> bool {
+  std::lock_guard guard(lock);
+  return nb_ended == parts.size();
+}
+
+auto Migration::run(ServerConnections &connections) -> void {
+  while (true) {
+    Part *part = nullptr;
+    {
+      std::lock_guard guard(lock);
+      if (next_part == parts.size()) {
+        return;
+      }
+      part = &parts[next_part++];
+    }
+    move_part(connections, *part);
+    {
+      std::lock_guard guard(lock);
+      ++nb_ended;
+    }
+    wake(notify_fd);
+  }
+}
+
+auto Migration::move_part(ServerConnections &connections, Part &part)
+    -> void {
+  for (int64_t first = part.move.start; first <= part.move.end;) {
+    std::optional<int32_t> last;
+    /* A page that failed stays in flight on its source until it moves */
+    for (auto backoff = std::chrono::milliseconds(min_retry_backoff);
+         !(last = move_page(connections, part, static_cast<int32_t>(first)));
+         backoff = std::min<std::chrono::milliseconds>(2 * backoff,
+                                                       max_retry_backoff)) {
+      std::this_thread::sleep_for(backoff);
+    }
+    {
+      std::lock_guard guard(lock);
+      part.moved_end = static_cast<int64_t>(*last) + 1;
+    }
+    wake(notify_fd);
+    first = static_cast<int64_t>(*last) + 1;
+  }
+}
+
+auto Migration::move_page(ServerConnections &connections, Part &part,
+                          int32_t first) -> std::optional<int32_t> {
+  auto const &move = part.move;
+  std::vector<int32_t> keys;
+  std::optional<int32_t> resume;
+  int32_t last = move.end;
+  /* The page of a failed try is moved again as it was */
+  if (part.flight_end > first) {
+    last = static_cast<int32_t>(part.flight_end - 1);
+  } else {
+    if (!list_keys(connections, move, first, last,
+                   static_cast<uint32_t>(options.batch_keys), keys, resume)) {
+      return std::nullopt;
+    }
+    if (resume) {
+      last = *resume - 1;
+    }
+    std::lock_guard guard(lock);
+    part.flight_end = static_cast<int64_t>(last) + 1;
+  }
+  /* The keys are listed again after the LEAVE, with the writes before it */
+  if (!move.held && !leave(connections, move, first, last)) {
+    return std::nullopt;
+  }
+  keys.clear();
+  for (resume = first; resume;) {
+    if (!list_keys(connections, move, *resume, last, 0, keys, resume)) {
+      return std::nullopt;
+    }
+  }
+  std::map<int, std::vector<int32_t>> by_destination;
+  for (auto key : keys) {
+    by_destination[part.placement != nullptr ? part.placement->owner(key)
+                                             : move.to]
+        .push_back(key);
+  }
+  for (auto &[to, moved] : by_destination) {
+    if (move.held && !drop_stale(connections, move.from, to, moved)) {
+      return std::nullopt;
+    }
+    if (moved.empty() ||
+        (moved.size() >= options.bulk_min_keys &&
+         bulk_move(connections, move.from, to, moved))) {
+      continue;
+    }
+    if (!batch_move(connections, move.from, to, moved)) {
+      return std::nullopt;
+    }
+  }
+  return last;
+}
@@ -0,0 +1,150 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "message.h"
+#include "placement.h"
+
+/**
+ ** Connections of one thread to the servers, by port, opened on first use
+ ** and kept open from one request to the next.
+ **/
+class ServerConnections {
+public:
+  ServerConnections() = default;
+  ServerConnections(ServerConnections const &) = delete;
+  auto operator=(ServerConnections const &) -> ServerConnections & = delete;
+  ~ServerConnections();
+
+  /**
+   ** It sends request to the server at port and reads its response.
+   **
+   ** @return false if the server could not be reached or did not answer;
+   ** the connection is then closed
+   **/
+  auto ask(int port, server::server_msg const &request,
+           server::server_msg &response) -> bool;
+
+  /**
+   ** It sends request to the server at port and visits the frames of its
+   ** response, like the ones of a SCAN, up to the first without more.
+   **/
+  auto ask_all(int port, server::server_msg const &request,
+               std::function<void(server::server_msg const &)> const &visit)
+      -> bool;
+
+  /* It sends frames of requests without a response, like DELETEs, at once. */
+  auto send(int port, std::string &frames) -> bool;
+
+private:
+  auto connection(int port) -> int;
+  auto drop(int port) -> void;
+  auto receive(int port, server::server_msg &response) -> bool;
+
+  std::map<int, int> fds;
+  std::string frame;
+};
+
+/**
+ ** Keys that move away from the server at port from: the ones from start to
+ ** end it holds that the placement of slice gives to another server, each
+ ** to its server there, or without a slice all of them, to the server at
+ ** port to. Held keys are the ones a joining server kept from before: they
+ ** are never routed to it, and a held key its shard already has is only
+ ** deleted.
+ **/
+struct KeyMove {
+  int from;
+  int32_t start;
+  int32_t end;
+  std::optional<server::server_msg::Slice> slice;
+  int to{0};
+  bool held{false};
+};
+
+/**
+ ** The moves of one rebalancing, run in the background while the master
+ ** keeps serving lookups. The master holds no key of them: the threads
+ ** list the keys of each move from its source with KEYS, a page of up to
+ ** batch_keys keys at a time in key order, and move them page by page.
+ **
+ ** Every move is cut into one part per thread, which the threads take in
+ ** turn, each over its own ServerConnections, so that they spread over the
+ ** sources. The keys of a page go by destination: at least bulk_min_keys of
+ ** them as one SST file (BOOTSTRAP_RECEIVE, BOOTSTRAP_SEND); fewer, or the
+ ** ones the destination cannot ingest, as one MULTI_GET from the source,
+ ** one MULTI_PUT to the destination and the DELETEs on the source in one
+ ** write.
+ **
+ ** Since a part moves in key order, the state of a key is where its part
+ ** got: a lookup goes to the source until the page of the key is listed and
+ ** to the destination once the page moved; in between it has to wait. A
+ ** page starts with a LEAVE of its keys on the source, which from then on
+ ** rejects the writes to them like ones routed by a stale map, and the
+ ** keys are only listed for the move after it. A client that was sent to
+ ** the source just before thus locates the key again and writes it on the
+ ** destination, instead of writing it on the source after the move read
+ ** it. A page that fails, e.g. as a server is down, stays in flight and is
+ ** tried again after a wait that doubles up to seconds: its keys are not
+ ** routed to a destination that does not have them.
+ **/
+class Migration {
+public:
+  enum class KeyState { pending, in_flight, moved };
+
+  struct Options {
+    size_t threads;
+    size_t batch_keys;
+    size_t bulk_min_keys;
+  };
+
+  /**
+   ** It starts the moves. No two of them take the same key from a source.
+   **
+   ** @param notify_fd a byte is written to it whenever a page moved
+   **/
+  Migration(std::vector<KeyMove> const &moves, Options options, int notify_fd);
+  Migration(Migration const &) = delete;
+  auto operator=(Migration const &) -> Migration & = delete;
+  ~Migration();
+
+  /**
+   ** @return how far the move of key away from the server at port from got;
+   ** a key that no move takes from there counts as moved
+   **/
+  [[nodiscard]] auto locate(int32_t key, int from) const -> KeyState;
+
+  /* @return true once every key moved */
+  [[nodiscard]] auto done() const -> bool;
+
+private:
+  /* A part of a move and how far it got */
+  struct Part {
+    KeyMove move;
+    std::unique_ptr<PlacementStrategy> placement; // of move.slice
+    int64_t moved_end;  // the keys before it moved
+    int64_t flight_end; // the keys from moved_end before it are in flight
+  };
+
+  auto run(ServerConnections &connections) -> void;
+  auto move_part(ServerConnections &connections, Part &part) -> void;
+  auto move_page(ServerConnections &connections, Part &part, int32_t first)
+      -> std::optional<int32_t>;
+
+  Options options;
+  int notify_fd;
+  std::vector<Part> parts;
+  mutable std::mutex lock; // of the progress of the parts
+  size_t next_part{0};
+  size_t nb_ended{0};
+  std::vector<std::thread> threads;
+};
@@ -0,0 +1,98 @@
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+#include "placement.h"
+
+#include "hash_ring.h"
+
+namespace {
+
+/**
+ ** Jump consistent hash of Lamping and Veach: the bucket in [0, nb_buckets)
+ ** of hash. Growing nb_buckets by one moves a key only into the new bucket.
+ **/
+auto jump_bucket(uint64_t hash, int64_t nb_buckets) -> int64_t {
+  int64_t bucket = -1;
+  int64_t next = 0;
+  while (next < nb_buckets) {
+    bucket = next;
+    hash = hash * 2862933555777941757ULL + 1;
+    next = static_cast<int64_t>(
+        static_cast<double>(bucket + 1) *
+        (static_cast<double>(1LL << 31) /
+         static_cast<double>((hash >> 33) + 1)));
+  }
+  return bucket;
+}
+
+/* The top 53 bits of hash as a double in (0, 1), never 0 nor 1 */
+auto unit_interval(uint64_t hash) -> double {
+  return (static_cast<double>(hash >> 11) + 0.5) * 0x1p-53;
+}
+
+} // namespace
+
+auto make_placement(std::string_view name, size_t vnodes)
+    -> std::unique_ptr<PlacementStrategy> {
+  if (name == "ring") {
+    return std::make_unique<HashRing>(vnodes);
+  }
+  if (name == "jump") {
+    return std::make_unique<JumpHash>();
+  }
+  if (name == "rendezvous") {
+    return std::make_unique<Rendezvous>();
+  }
+  return nullptr;
+}
+
+auto JumpHash::add(int server, uint32_t /*weight*/) -> void {
+  if (std::find(servers.begin(), servers.end(), server) == servers.end()) {
+    servers.push_back(server);
+  }
+}
+
+auto JumpHash::owner(int32_t key) const -> int {
+  auto bucket =
+      jump_bucket(key_hash(key), static_cast<int64_t>(servers.size()));
+  return servers[static_cast<size_t>(bucket)];
+}
+
+auto JumpHash::clone() const -> std::unique_ptr<PlacementStrategy> {
+  return std::make_unique<JumpHash>(*this);
+}
+
+auto Rendezvous::add(int server, uint32_t weight) -> void {
+  auto it = std::find_if(servers.begin(), servers.end(),
+                         [server](auto const &s) { return s.port == server; });
+  auto w = static_cast<double>(std::max<uint32_t>(weight, 1));
+  if (it != servers.end()) {
+    it->weight = w;
+    return;
+  }
+  servers.push_back(
+      {server, mix64(static_cast<uint64_t>(static_cast<uint32_t>(server)) << 32),
+       w});
+}
+
+auto Rendezvous::owner(int32_t key) const -> int {
+  auto hash = key_hash(key);
+  int best = servers.front().port;
+  double best_score = -std::numeric_limits<double>::infinity();
+  for (auto const &server : servers) {
+    /* -ln(u) / weight is exponential with rate weight, so the server with
+       the lowest, the highest score, wins with P = weight / total weight */
+    auto score =
+        -server.weight / std::log(unit_interval(mix64(hash ^ server.seed)));
+    if (score > best_score) {
+      best_score = score;
+      best = server.port;
+    }
+  }
+  return best;
+}
+
+auto Rendezvous::clone() const -> std::unique_ptr<PlacementStrategy> {
+  return std::make_unique<Rendezvous>(*this);
+}
@@ -0,0 +1,120 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string_view>
+#include <vector>
+
+/**
+ ** How the master places the keys on the servers of the cluster, by port.
+ **
+ **  - ring: the consistent-hash ring of HashRing, vnodes tokens per unit of
+ **    weight; O(log(tokens)) per key and a joining server takes about 1/N of
+ **    the keys.
+ **  - jump: jump consistent hash over the servers in join order; no state
+ **    beyond the list of ports, O(log N) per key, an exact 1/N move on a
+ **    join, but it cannot weight servers and only the last one could leave.
+ **  - rendezvous: weighted highest-random-weight hashing; the owner of a key
+ **    is the server with the highest -weight / ln(hash(key, server)), so it
+ **    costs O(N) per key, but any server can join or leave and keys spread
+ **    in proportion to the weights.
+ **
+ ** The strategies are deterministic in the ports and weights (and for jump,
+ ** the join order), so a copy with one more server tells which keys a join
+ ** moves. Range placement is not one of them: its table depends on the
+ ** keys and their load, see RangeTable.
+ **/
+class PlacementStrategy {
+public:
+  virtual ~PlacementStrategy() = default;
+
+  /* It adds server, or sets its weight if it is already placed; weight >= 1 */
+  virtual auto add(int server, uint32_t weight) -> void = 0;
+
+  /* @return the port of the server of key; the placement must not be empty */
+  [[nodiscard]] virtual auto owner(int32_t key) const -> int = 0;
+
+  [[nodiscard]] virtual auto empty() const -> bool = 0;
+
+  [[nodiscard]] virtual auto clone() const
+      -> std::unique_ptr<PlacementStrategy> = 0;
+};
+
+inline constexpr std::string_view default_placement{"ring"};
+inline constexpr std::string_view placement_names{"ring, jump, rendezvous"};
+
+/**
+ ** It builds an empty placement of strategy name.
+ **
+ ** @param vnodes the tokens per unit of weight of ring, unused by the others
+ ** @return nullptr for an unknown name
+ **/
+auto make_placement(std::string_view name, size_t vnodes)
+    -> std::unique_ptr<PlacementStrategy>;
+
+/**
+ ** It builds the placement of strategy name over servers, in join order,
+ ** with the weights of the servers in the same order, 1 for the missing.
+ **
+ ** @return nullptr for an unknown name or without servers
+ **/
+template <typename Ports, typename Weights>
+auto make_placement(std::string_view name, size_t vnodes, Ports const &servers,
+                    Weights const &weights)
+    -> std::unique_ptr<PlacementStrategy> {
+  auto placement = make_placement(name, vnodes);
+  if (placement == nullptr || servers.empty()) {
+    return nullptr;
+  }
+  auto weight = weights.begin();
+  for (int server : servers) {
+    placement->add(server, weight != weights.end() ? *weight++ : 1);
+  }
+  return placement;
+}
+
+/* The finalizer of SplitMix64, which spreads neighbouring inputs apart. */
+inline auto mix64(uint64_t x) -> uint64_t {
+  x ^= x >> 30;
+  x *= 0xbf58476d1ce4e5b9ULL;
+  x ^= x >> 27;
+  x *= 0x94d049bb133111ebULL;
+  x ^= x >> 31;
+  return x;
+}
+
+inline auto key_hash(int32_t key) -> uint64_t {
+  return mix64(static_cast<uint32_t>(key));
+}
+
+class JumpHash : public PlacementStrategy {
+public:
+  /* A new server is appended; jump cannot weight servers, weight is ignored */
+  auto add(int server, uint32_t weight) -> void override;
+  [[nodiscard]] auto owner(int32_t key) const -> int override;
+  [[nodiscard]] auto empty() const -> bool override { return servers.empty(); }
+  [[nodiscard]] auto clone() const
+      -> std::unique_ptr<PlacementStrategy> override;
+
+private:
+  std::vector<int> servers; // bucket i is servers[i], in join order
+};
+
+class Rendezvous : public PlacementStrategy {
+public:
+  auto add(int server, uint32_t weight) -> void override;
+  [[nodiscard]] auto owner(int32_t key) const -> int override;
+  [[nodiscard]] auto empty() const -> bool override { return servers.empty(); }
+  [[nodiscard]] auto clone() const
+      -> std::unique_ptr<PlacementStrategy> override;
+
+private:
+  struct Server {
+    int port;
+    uint64_t seed; // mixed into the hash of every key
+    double weight;
+  };
+
+  std::vector<Server> servers;
+};
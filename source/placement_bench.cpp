@@ -0,0 +1,150 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+#include <cxxopts.hpp>
+#include <fmt/core.h>
+#include "hash_ring.h"
+#include "placement.h"
+
+/* Port of the first server of the simulated cluster */
+constexpr int first_port = 20000;
+
+/* The strategies that are compared */
+const char *strategies[] = {"ring", "jump", "rendezvous"};
+
+/**
+ * It reads the keys of the file at path, one decimal key per line.
+ *
+ * @return false if the file could not be opened
+ */
+bool read_keys(const std::string &path, std::vector<int32_t> &keys)
+{
+    std::ifstream in(path);
+    if (!in)
+    {
+        return false;
+    }
+    int32_t key;
+    while (in >> key)
+    {
+        keys.push_back(key);
+    }
+    return true;
+}
+
+/**
+ * It places keys with strategy name on a cluster of servers of the given
+ * weights, then adds one server of weight 1, and prints the lookup time, the
+ * spread of the keys and the fraction of keys the join moved.
+ */
+void run(const char *name, size_t vnodes, const std::vector<uint32_t> &weights, const std::vector<int32_t> &keys)
+{
+    auto placement = make_placement(name, vnodes);
+    uint64_t total_weight = 0;
+    for (size_t i = 0; i < weights.size(); ++i)
+    {
+        placement->add(first_port + static_cast<int>(i), weights[i]);
+        total_weight += weights[i];
+    }
+
+    std::vector<int> owners(keys.size());
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < keys.size(); ++i)
+    {
+        owners[i] = placement->owner(keys[i]);
+    }
+    std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+
+    /* The keys of every server relative to its share of the total weight */
+    std::map<int, size_t> counts;
+    for (int owner : owners)
+    {
+        ++counts[owner];
+    }
+    double max_load = 0;
+    double min_load = keys.empty() ? 0 : 1e300;
+    for (size_t i = 0; i < weights.size(); ++i)
+    {
+        double fair = static_cast<double>(keys.size()) * weights[i] / total_weight;
+        double load = counts[first_port + static_cast<int>(i)] / fair;
+        max_load = std::max(max_load, load);
+        min_load = std::min(min_load, load);
+    }
+
+    auto grown = placement->clone();
+    grown->add(first_port + static_cast<int>(weights.size()), 1);
+    size_t moved = 0;
+    for (size_t i = 0; i < keys.size(); ++i)
+    {
+        moved += grown->owner(keys[i]) != owners[i];
+    }
+
+    fmt::print("{:<12}{:>12.1f}{:>12.3f}{:>12.3f}{:>12.4f}{:>12.4f}\n", name,
+               keys.empty() ? 0.0 : elapsed.count() / keys.size(), max_load, min_load,
+               keys.empty() ? 0.0 : static_cast<double>(moved) / keys.size(), 1.0 / (total_weight + 1));
+}
+
+int main(int argc, char *argv[])
+{
+    /* This is parsing the command line arguments. */
+    cxxopts::Options options(argv[0], "Compares the placement strategies of the master on a set of keys");
+    options.allow_unrecognised_options().add_options()(
+        "s,servers", "Number of servers of the cluster.",
+        cxxopts::value<size_t>()->default_value("8"))(
+        "w,weights", "Comma-separated weights of the servers, 1 for the ones not listed.",
+        cxxopts::value<std::vector<uint32_t>>())(
+        "k,keys", "File of the keys to place, one decimal key per line; without it the keys 0 to COUNT - 1.",
+        cxxopts::value<std::string>())(
+        "n,count", "Number of keys to place without a key file.",
+        cxxopts::value<size_t>()->default_value("1000000"))(
+        "vnodes", "Number of points of every server, per unit of weight, on the consistent-hash ring.",
+        cxxopts::value<size_t>()->default_value(std::to_string(HashRing::default_vnodes)))("h,help", "Print help");
+
+    auto args = options.parse(argc, argv);
+    if (args.count("help"))
+    {
+        fmt::print("{}\n", options.help());
+        return 0;
+    }
+
+    size_t nb_servers = std::max<size_t>(args["servers"].as<size_t>(), 1);
+    std::vector<uint32_t> weights(nb_servers, 1);
+    auto listed = args.count("weights") ? args["weights"].as<std::vector<uint32_t>>() : std::vector<uint32_t>();
+    for (size_t i = 0; i < listed.size() && i < nb_servers; ++i)
+    {
+        weights[i] = std::max<uint32_t>(listed[i], 1);
+    }
+
+    std::vector<int32_t> keys;
+    if (args.count("keys"))
+    {
+        if (!read_keys(args["keys"].as<std::string>(), keys))
+        {
+            fmt::print(stderr, "Cannot read the keys of {}\n", args["keys"].as<std::string>());
+            return 1;
+        }
+    }
+    else
+    {
+        size_t count = args["count"].as<size_t>();
+        keys.reserve(count);
+        for (size_t i = 0; i < count; ++i)
+        {
+            keys.push_back(static_cast<int32_t>(i));
+        }
+    }
+
+    fmt::print("{} keys on {} servers\n", keys.size(), nb_servers);
+    /* The load is the keys of a server over its fair share; moved is the fraction of keys a join of one more server moves */
+    fmt::print("{:<12}{:>12}{:>12}{:>12}{:>12}{:>12}\n", "strategy", "ns/lookup", "max load", "min load", "moved", "ideal");
+    for (auto name : strategies)
+    {
+        run(name, args["vnodes"].as<size_t>(), weights, keys);
+    }
+    return 0;
+}
@@ -0,0 +1,38 @@
+#include <algorithm>
+#include <limits>
+
+#include "range_table.h"
+
+auto RangeTable::assign_all(int server) -> void {
+  ranges = {{std::numeric_limits<int32_t>::min(),
+             std::numeric_limits<int32_t>::max(), server}};
+}
+
+auto RangeTable::find(int32_t key) const -> size_t {
+  auto it = std::upper_bound(
+      ranges.begin(), ranges.end(), key,
+      [](int32_t key, KeyRange const &range) { return key < range.start; });
+  return static_cast<size_t>(it - ranges.begin()) - 1;
+}
+
+auto RangeTable::split(size_t i, int32_t at, int server) -> void {
+  auto &lower = ranges[i];
+  KeyRange upper{at, lower.end, server};
+  lower.end = at - 1;
+  ranges.insert(ranges.begin() + static_cast<ptrdiff_t>(i) + 1, upper);
+}
+
+auto RangeTable::merge(size_t i, int server) -> void {
+  auto &lower = ranges[i];
+  auto const &upper = ranges[i + 1];
+  lower.end = upper.end;
+  lower.server = server;
+  ranges.erase(ranges.begin() + static_cast<ptrdiff_t>(i) + 1);
+}
+
+auto RangeTable::count(int server) const -> size_t {
+  return static_cast<size_t>(
+      std::count_if(ranges.begin(), ranges.end(), [server](auto const &range) {
+        return range.server == server;
+      }));
+}
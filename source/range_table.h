@@ -0,0 +1,57 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+/**
+ ** Range placement of the keys: a sorted table of disjoint key ranges that
+ ** together cover every int32 key, each owned by one server (by port).
+ **
+ ** Unlike a hash, the ranges keep neighbouring keys together, so a move is
+ ** the copy of a contiguous range and a hot or large range can be split
+ ** where its keys are, whatever their distribution.
+ **/
+struct KeyRange {
+  int32_t start;
+  int32_t end; // included
+  int server;
+
+  [[nodiscard]] auto contains(int32_t key) const -> bool {
+    return start <= key && key <= end;
+  }
+};
+
+class RangeTable {
+public:
+  [[nodiscard]] auto empty() const -> bool { return ranges.empty(); }
+  [[nodiscard]] auto size() const -> size_t { return ranges.size(); }
+  [[nodiscard]] auto operator[](size_t i) const -> KeyRange const & {
+    return ranges[i];
+  }
+
+  /* It gives all keys to server, as the only range. */
+  auto assign_all(int server) -> void;
+
+  /* @return the index of the range of key; the table must not be empty */
+  [[nodiscard]] auto find(int32_t key) const -> size_t;
+
+  [[nodiscard]] auto owner(int32_t key) const -> int {
+    return ranges[find(key)].server;
+  }
+
+  /**
+   ** It splits range i before at, which must be in it and above its start,
+   ** and gives the upper part, from at on, to server.
+   **/
+  auto split(size_t i, int32_t at, int server) -> void;
+
+  /* It merges range i with range i + 1 into one range owned by server. */
+  auto merge(size_t i, int server) -> void;
+
+  /* @return the number of ranges server owns */
+  [[nodiscard]] auto count(int server) const -> size_t;
+
+private:
+  std::vector<KeyRange> ranges; // by start
+};
@@ -0,0 +1,1071 @@
+#include <algorithm>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "request_handler.h"
+
+#include "binary_protocol.h"
+#include "bootstrap.h"
+#include "counter_merge.h"
+#include "key_encoding.h"
+#include "message.h"
+#include "placement.h"
+#include "rocksdb/write_batch.h"
+#include "shared.h"
+#include "value_ttl.h"
+
+namespace {
+
+/* Target size of one SCAN response frame. */
+constexpr size_t scan_frame_bytes = 64 << 10;
+/* Bytes of pairs after which a SCAN request stops and returns a resume_key. */
+constexpr size_t scan_request_bytes = 4 << 20;
+/* Encoding bytes of a SCAN entry on top of its value. */
+constexpr size_t scan_entry_overhead = 16;
+
+/* The value behind a stored one, or nothing if it expired. */
+auto live_value(rocksdb::Slice stored, int64_t now)
+    -> std::optional<StoredValue> {
+  auto live = load_value(stored);
+  if (live.expired(now)) {
+    return std::nullopt;
+  }
+  return live;
+}
+
+/**
+ ** It sets the value of a GET response, and its time left, from value as
+ ** read from the engine.
+ **
+ ** @return false if the value expired
+ **/
+auto set_live_value(rocksdb::Slice value, server::server_msg &response)
+    -> bool {
+  auto now = now_ms();
+  auto live = live_value(value, now);
+  if (!live) {
+    return false;
+  }
+  if (live->expires_at_ms != 0) {
+    response.set_ttl_ms(static_cast<uint64_t>(live->expires_at_ms - now));
+  }
+  response.set_value(live->value.data(), live->value.size());
+  return true;
+}
+
+/**
+ ** The buffer of the values a GET of this thread copies rather than pins,
+ ** which keeps its capacity from one GET to the next.
+ **/
+thread_local std::string read_buffer;
+
+/**
+ ** The messages of the requests this thread runs, and the keys, values and
+ ** batch of its MULTI_GETs and MULTI_PUTs. Clearing them keeps the memory of
+ ** their strings and entries, so once they are warm a request, even a
+ ** MULTI_GET of thousands of keys, is parsed and answered without allocating
+ ** beyond what the engine returns, the statuses of a MultiGet.
+ **/
+thread_local server::server_msg request_message;
+thread_local server::server_msg response_message;
+thread_local std::vector<EncodedKey> multi_get_keys;
+thread_local std::vector<rocksdb::Slice> multi_get_slices;
+thread_local std::vector<std::string> multi_get_values;
+thread_local rocksdb::WriteBatch multi_put_batch;
+
+/* The response of a GET the response cache missed, before it is cached. */
+thread_local std::string miss_payload;
+
+/* The expiry of a value written with ttl_ms left, 0 for none. */
+auto expiry(uint64_t ttl_ms) -> int64_t {
+  return ttl_ms > 0 ? now_ms() + static_cast<int64_t>(ttl_ms) : 0;
+}
+
+/* The stored form of the value of a PUT, built in scratch if needed. */
+auto put_value(server::server_msg const &request, std::string *scratch)
+    -> rocksdb::Slice {
+  return store_value(request.value(), expiry(request.ttl_ms()), scratch);
+}
+
+/* It looks all keys of the request up with one MultiGet call. */
+auto multi_get(StorageEngine *engine, server::server_msg const &request,
+               server::server_msg &response) -> void {
+  auto &keys = multi_get_keys;
+  keys.clear();
+  for (auto const &entry : request.entries()) {
+    keys.push_back(encode_key(entry.key()));
+  }
+  auto &key_slices = multi_get_slices;
+  key_slices.clear();
+  for (auto const &key : keys) {
+    key_slices.push_back(key_slice(key));
+  }
+  auto &values = multi_get_values;
+  auto statuses = engine->multi_get(key_slices, &values);
+  bool success = true;
+  bool all_exist = true;
+  auto now = now_ms();
+  for (size_t i = 0; i < statuses.size(); ++i) {
+    auto *entry = response.add_entries();
+    entry->set_key(request.entries(static_cast<int>(i)).key());
+    std::optional<StoredValue> live;
+    if (statuses[i].ok()) {
+      live = live_value(values[i], now);
+    }
+    entry->set_key_exists(live.has_value());
+    if (live) {
+      entry->set_value(live->value.data(), live->value.size());
+      if (live->expires_at_ms != 0) {
+        entry->set_ttl_ms(static_cast<uint64_t>(live->expires_at_ms - now));
+      }
+    } else if (statuses[i].ok()) {
+      all_exist = false;
+    } else {
+      all_exist = false;
+      success = success && statuses[i].IsNotFound();
+    }
+  }
+  response.set_key_exists(all_exist);
+  response.set_success(success);
+}
+
+/* It writes all key/value pairs of the request as one atomic WriteBatch. */
+auto multi_put(StorageEngine *engine, server::server_msg const &request,
+               server::server_msg &response) -> void {
+  auto &batch = multi_put_batch;
+  batch.Clear();
+  std::string scratch;
+  for (auto const &entry : request.entries()) {
+    batch.Put(key_slice(encode_key(entry.key())),
+              store_value(entry.value(), expiry(entry.ttl_ms()), &scratch));
+  }
+  auto status = engine->write(&batch, false);
+  response.set_success(status.ok());
+}
+
+/* It runs the sending end of a bulk transfer of the keys of entries. */
+auto bootstrap_send(Store const &store, server::server_msg const &request,
+                    server::server_msg &response) -> void {
+  std::vector<int32_t> keys;
+  keys.reserve(request.entries_size());
+  for (auto const &entry : request.entries()) {
+    keys.push_back(entry.key());
+  }
+  auto status = send_sst(store, keys, request.peer_port());
+  if (!status.ok()) {
+    debug_print("[{}] {}\n", __func__, status.ToString());
+  }
+  response.set_success(status.ok());
+}
+
+/* It starts the response with the fields every response echoes. */
+auto start_response(server::server_msg const &request,
+                    server::server_msg &response) -> void {
+  response.Clear();
+  response.set_operation(request.operation());
+  response.set_key(request.key());
+  if (request.has_request_id()) {
+    response.set_request_id(request.request_id());
+  }
+  // assume key exists, make it false if not found in get request
+  response.set_key_exists(true);
+}
+
+/* It runs a BOOTSTRAP_SEND and appends its response to out. */
+auto run_transfer(Store const &store, server::server_msg const &request,
+                  std::string &out) -> void {
+  server::server_msg response;
+  start_response(request, response);
+  bootstrap_send(store, request, response);
+  append_serialized(out, response);
+}
+
+/**
+ ** It runs a SCAN and appends its response as a series of frames of about
+ ** scan_frame_bytes, all but the last with more set. Once the frames of one
+ ** request hold scan_request_bytes it stops and hands the client the key to
+ ** SCAN again from, so one request never buffers an unbounded range.
+ **/
+auto scan(StorageEngine *engine, server::server_msg const &request,
+          server::server_msg &response, std::string &out) -> void {
+  start_response(request, response);
+  response.set_success(true);
+  uint32_t count = 0;
+  size_t frame_bytes = 0;
+  size_t request_bytes = 0;
+  auto flush = [&](bool more) {
+    response.set_more(more);
+    append_serialized(out, response);
+    response.clear_entries();
+    frame_bytes = 0;
+  };
+  auto start = encode_key(request.key());
+  auto end = encode_key(request.end_key());
+  auto now = now_ms();
+  auto status = engine->scan(
+      key_slice(start), key_slice(end),
+      [&](rocksdb::Slice key, rocksdb::Slice value) {
+        /* Keys of other sizes are metadata like the format marker */
+        auto live = live_value(value, now);
+        if (key.size() != encoded_key_size || !live) {
+          return true;
+        }
+        value = live->value;
+        if (request.limit() > 0 && count == request.limit()) {
+          return false;
+        }
+        if (request_bytes >= scan_request_bytes) {
+          response.set_resume_key(decode_key(key.data()));
+          return false;
+        }
+        if (frame_bytes >= scan_frame_bytes) {
+          flush(true);
+        }
+        auto *entry = response.add_entries();
+        entry->set_key(decode_key(key.data()));
+        entry->set_value(value.data(), value.size());
+        ++count;
+        frame_bytes += value.size() + scan_entry_overhead;
+        request_bytes += value.size() + scan_entry_overhead;
+        return true;
+      });
+  response.set_success(status.ok());
+  flush(false);
+}
+
+/**
+ ** It rebuilds the placement of the slice of a KEYS or LEAVE request.
+ **
+ ** @return nullptr for an unknown placement or one without servers
+ **/
+auto slice_placement(server::server_msg::Slice const &slice)
+    -> std::unique_ptr<PlacementStrategy> {
+  return make_placement(slice.placement(), slice.vnodes(), slice.servers(),
+                        slice.weights());
+}
+
+/**
+ ** It runs a KEYS request: the live keys of the range, of the slice if the
+ ** request has one, streamed like the pairs of a SCAN but without values.
+ ** It stops with a resume_key at limit keys, or at the same amount of
+ ** entries as a SCAN.
+ **/
+auto list_keys(StorageEngine *engine, server::server_msg const &request,
+               server::server_msg &response, std::string &out) -> void {
+  start_response(request, response);
+  std::unique_ptr<PlacementStrategy> placement;
+  if (request.has_slice()) {
+    placement = slice_placement(request.slice());
+    if (placement == nullptr) {
+      response.set_success(false);
+      append_serialized(out, response);
+      return;
+    }
+  }
+  response.set_success(true);
+  uint32_t count = 0;
+  size_t frame_bytes = 0;
+  size_t request_bytes = 0;
+  auto flush = [&](bool more) {
+    response.set_more(more);
+    append_serialized(out, response);
+    response.clear_entries();
+    frame_bytes = 0;
+  };
+  auto start = encode_key(request.key());
+  auto end = encode_key(request.end_key());
+  auto now = now_ms();
+  auto status = engine->scan(
+      key_slice(start), key_slice(end),
+      [&](rocksdb::Slice key, rocksdb::Slice value) {
+        if (key.size() != encoded_key_size || !live_value(value, now)) {
+          return true;
+        }
+        auto decoded = decode_key(key.data());
+        if (placement != nullptr &&
+            placement->owner(decoded) == request.peer_port()) {
+          return true;
+        }
+        if ((request.limit() > 0 && count == request.limit()) ||
+            request_bytes >= scan_request_bytes) {
+          response.set_resume_key(decoded);
+          return false;
+        }
+        if (frame_bytes >= scan_frame_bytes) {
+          flush(true);
+        }
+        response.add_entries()->set_key(decoded);
+        ++count;
+        frame_bytes += scan_entry_overhead;
+        request_bytes += scan_entry_overhead;
+        return true;
+      });
+  response.set_success(status.ok());
+  flush(false);
+}
+
+/**
+ ** It runs a KEY_COUNT request with two passes over the range: one counts
+ ** the live keys, the other stops at the median.
+ **/
+auto count_keys(StorageEngine *engine, server::server_msg const &request,
+                server::server_msg &response) -> void {
+  start_response(request, response);
+  auto start = encode_key(request.key());
+  auto end = encode_key(request.end_key());
+  auto now = now_ms();
+  uint64_t count = 0;
+  auto status = engine->scan(
+      key_slice(start), key_slice(end),
+      [&](rocksdb::Slice key, rocksdb::Slice value) {
+        if (key.size() == encoded_key_size && live_value(value, now)) {
+          ++count;
+        }
+        return true;
+      });
+  uint64_t index = 0;
+  if (status.ok() && count > 0) {
+    status = engine->scan(
+        key_slice(start), key_slice(end),
+        [&](rocksdb::Slice key, rocksdb::Slice value) {
+          if (key.size() != encoded_key_size || !live_value(value, now)) {
+            return true;
+          }
+          if (index++ < count / 2) {
+            return true;
+          }
+          response.set_median_key(decode_key(key.data()));
+          return false;
+        });
+  }
+  response.set_nb_keys(count);
+  response.set_success(status.ok());
+}
+
+auto is_write(server::server_msg const &request) -> bool {
+  return request.operation() == server::server_msg::PUT ||
+         request.operation() == server::server_msg::DELETE ||
+         request.operation() == server::server_msg::MULTI_PUT ||
+         request.operation() == server::server_msg::MERGE;
+}
+
+/**
+ ** @return true for a request that runs on a thread of its own: a
+ ** BOOTSTRAP_SEND holds its thread for a whole SST transfer
+ **/
+auto runs_apart(server::server_msg const &request) -> bool {
+  return request.operation() == server::server_msg::BOOTSTRAP_SEND;
+}
+
+auto is_single_key(server::server_msg const &request) -> bool {
+  return request.operation() == server::server_msg::GET ||
+         request.operation() == server::server_msg::PUT ||
+         request.operation() == server::server_msg::DELETE ||
+         request.operation() == server::server_msg::MERGE;
+}
+
+auto counter_operand(server::server_msg const &request) -> std::string {
+  return encode_counter_operand(static_cast<CounterOp>(request.counter_op()),
+                                request.operand(), now_ms());
+}
+
+/* It adds the updates of a write request to a batch. */
+auto fill_batch(server::server_msg const &request, rocksdb::WriteBatch &batch)
+    -> void {
+  std::string scratch;
+  if (request.operation() == server::server_msg::PUT) {
+    batch.Put(key_slice(encode_key(request.key())), put_value(request, &scratch));
+  } else if (request.operation() == server::server_msg::DELETE) {
+    batch.Delete(key_slice(encode_key(request.key())));
+  } else if (request.operation() == server::server_msg::MERGE) {
+    batch.Merge(key_slice(encode_key(request.key())), counter_operand(request));
+  } else {
+    for (auto const &entry : request.entries()) {
+      batch.Put(key_slice(encode_key(entry.key())),
+                store_value(entry.value(), expiry(entry.ttl_ms()), &scratch));
+    }
+  }
+}
+
+/* It drops the cached responses of the keys a write request updated. */
+auto invalidate(ResponseCache *cache, server::server_msg const &request)
+    -> void {
+  if (cache == nullptr) {
+    return;
+  }
+  if (request.operation() == server::server_msg::MULTI_PUT) {
+    for (auto const &entry : request.entries()) {
+      cache->invalidate(entry.key());
+    }
+  } else {
+    cache->invalidate(request.key());
+  }
+}
+
+/**
+ ** @return true for a PUT, MERGE or MULTI_PUT on a key that a migration
+ ** moves away; the DELETEs of the migration itself still run
+ **/
+auto writes_leaving_key(ShardMapState const &map,
+                        server::server_msg const &request) -> bool {
+  switch (request.operation()) {
+  case server::server_msg::PUT:
+  case server::server_msg::MERGE:
+    return map.leaving(request.key());
+  case server::server_msg::MULTI_PUT:
+    return std::any_of(
+        request.entries().begin(), request.entries().end(),
+        [&map](auto const &entry) { return map.leaving(entry.key()); });
+  default:
+    return false;
+  }
+}
+
+/**
+ ** It checks a request against the shard map of the server, and counts the
+ ** keys of one that a client routed by the map.
+ **
+ ** @return false if the request was routed by another version of the map,
+ ** or writes a key that moves away
+ **/
+auto admit(Store const &store, server::server_msg const &request) -> bool {
+  if (store.map == nullptr ||
+      request.operation() == server::server_msg::MAP_VERSION) {
+    return true;
+  }
+  if (writes_leaving_key(*store.map, request)) {
+    return false;
+  }
+  if (!request.has_map_version()) {
+    return true;
+  }
+  if (!store.map->admits(request.map_version())) {
+    return false;
+  }
+  if (is_single_key(request)) {
+    store.map->count(request.key());
+  } else {
+    for (auto const &entry : request.entries()) {
+      store.map->count(entry.key());
+    }
+  }
+  return true;
+}
+
+/**
+ ** It runs a LEAVE: the writes to its keys are rejected from then on. With
+ ** a group committer it returns once the writes admitted before are
+ ** committed, so that the move that follows reads them.
+ **/
+auto leave(Store const &store, server::server_msg const &request) -> bool {
+  if (store.map == nullptr) {
+    return false;
+  }
+  std::unique_ptr<PlacementStrategy> placement;
+  if (request.has_slice()) {
+    placement = slice_placement(request.slice());
+    if (placement == nullptr) {
+      return false;
+    }
+  }
+  store.map->leave(request.key(), request.end_key(), std::move(placement),
+                   request.peer_port());
+  if (store.committer != nullptr) {
+    /* The writes are called back in order, so an empty one comes last */
+    std::promise<void> committed;
+    store.committer->write([](rocksdb::WriteBatch & /*batch*/) {},
+                           [&committed](rocksdb::Status const & /*status*/) {
+                             committed.set_value();
+                           });
+    committed.get_future().wait();
+  }
+  return true;
+}
+
+/* It answers a request routed by a stale map with the version it should have */
+auto reject(Store const &store, server::server_msg const &request,
+            std::string &out) -> void {
+  if (request.operation() == server::server_msg::DELETE) {
+    return;
+  }
+  auto &response = response_message;
+  start_response(request, response);
+  response.set_success(false);
+  response.set_map_version(store.map->version());
+  append_serialized(out, response);
+}
+
+/**
+ ** It answers a GET from the response cache, or from the engine and then
+ ** caches the response.
+ **/
+auto cached_get(Store const &store, server::server_msg const &request,
+                server::server_msg &response, std::string &out) -> void {
+  std::optional<uint64_t> request_id;
+  if (request.has_request_id()) {
+    request_id = request.request_id();
+  }
+  if (store.cache->lookup(request.key(), request_id, out)) {
+    return;
+  }
+  auto ticket = store.cache->ticket(request.key());
+  response.Clear();
+  response.set_operation(request.operation());
+  response.set_key(request.key());
+  rocksdb::PinnableSlice value(&read_buffer);
+  auto key = encode_key(request.key());
+  auto status = store.engine->get(key_slice(key), &value);
+  bool live = status.ok() && set_live_value(value, response);
+  response.set_key_exists(live);
+  response.set_success(live);
+  auto &payload = miss_payload;
+  response.SerializeToString(&payload);
+  /* The time left of an expiring value is stale once cached. */
+  if ((status.ok() || status.IsNotFound()) && !response.has_ttl_ms()) {
+    store.cache->fill(request.key(), ticket, payload);
+  }
+  ResponseCache::append_response(out, payload, request_id);
+}
+
+/* A binary request, with its value in place in the receive buffer. */
+struct BinaryRequest {
+  BinaryHeader header;
+  rocksdb::Slice value;
+};
+
+auto is_write(BinaryRequest const &request) -> bool {
+  auto operation = request.header.operation;
+  return operation == server::server_msg::PUT ||
+         operation == server::server_msg::DELETE ||
+         operation == server::server_msg::MERGE;
+}
+
+auto put_value(BinaryRequest const &request, std::string *scratch)
+    -> rocksdb::Slice {
+  int64_t expires_at_ms = 0;
+  if (request.header.arg > 0) {
+    expires_at_ms = now_ms() + request.header.arg;
+  }
+  return store_value(request.value, expires_at_ms, scratch);
+}
+
+auto counter_operand(BinaryRequest const &request) -> std::string {
+  return encode_counter_operand(
+      static_cast<CounterOp>(request.header.counter_op), request.header.arg,
+      now_ms());
+}
+
+auto fill_batch(BinaryRequest const &request, rocksdb::WriteBatch &batch)
+    -> void {
+  auto key = encode_key(request.header.key);
+  std::string scratch;
+  if (request.header.operation == server::server_msg::PUT) {
+    batch.Put(key_slice(key), put_value(request, &scratch));
+  } else if (request.header.operation == server::server_msg::DELETE) {
+    batch.Delete(key_slice(key));
+  } else if (request.header.operation == server::server_msg::MERGE) {
+    batch.Merge(key_slice(key), counter_operand(request));
+  }
+}
+
+auto invalidate(ResponseCache *cache, BinaryRequest const &request) -> void {
+  if (cache != nullptr) {
+    cache->invalidate(request.header.key);
+  }
+}
+
+/* It starts the response with the fields every response echoes. */
+auto start_response(BinaryRequest const &request) -> BinaryHeader {
+  BinaryHeader response{};
+  response.operation = request.header.operation;
+  response.key = request.header.key;
+  response.request_id = request.header.request_id;
+  return response;
+}
+
+auto admit(Store const &store, BinaryRequest const &request) -> bool {
+  if (store.map == nullptr) {
+    return true;
+  }
+  auto operation = request.header.operation;
+  if ((operation == server::server_msg::PUT ||
+       operation == server::server_msg::MERGE) &&
+      store.map->leaving(request.header.key)) {
+    return false;
+  }
+  if (request.header.map_version == 0) {
+    return true;
+  }
+  if (!store.map->admits_low(request.header.map_version)) {
+    return false;
+  }
+  store.map->count(request.header.key);
+  return true;
+}
+
+auto reject(Store const &store, BinaryRequest const &request, std::string &out)
+    -> void {
+  auto response = start_response(request);
+  response.flags = binary_stale_map;
+  response.map_version = static_cast<uint32_t>(store.map->version());
+  append_binary_frame(out, response, {});
+}
+
+/**
+ ** It runs a binary request on the engine and appends its response to out.
+ ** The response cache only holds server_msg responses, so a GET skips it.
+ **/
+auto handle_binary_request(Store const &store, BinaryRequest const &request,
+                           std::string &out) -> void {
+  if (!admit(store, request)) {
+    reject(store, request, out);
+    return;
+  }
+  auto *engine = store.engine;
+  auto response = start_response(request);
+  auto key = encode_key(request.header.key);
+  rocksdb::PinnableSlice value(&read_buffer);
+  rocksdb::Slice response_value;
+  std::string scratch;
+  rocksdb::Status status;
+  if (request.header.operation == server::server_msg::GET) {
+    status = engine->get(key_slice(key), &value);
+    auto now = now_ms();
+    std::optional<StoredValue> live;
+    if (status.ok()) {
+      live = live_value(value, now);
+    }
+    if (live) {
+      response.flags = binary_success | binary_key_exists;
+      response_value = live->value;
+      if (live->expires_at_ms != 0) {
+        response.arg = live->expires_at_ms - now;
+      }
+    }
+    append_binary_frame(out, response,
+                        {response_value.data(), response_value.size()});
+    return;
+  }
+  if (request.header.operation == server::server_msg::PUT) {
+    status = engine->put(key_slice(key), put_value(request, &scratch));
+  } else if (request.header.operation == server::server_msg::DELETE) {
+    status = engine->remove(key_slice(key));
+  } else if (request.header.operation == server::server_msg::MERGE) {
+    status = engine->merge(key_slice(key), counter_operand(request));
+  } else {
+    status = rocksdb::Status::NotSupported();
+  }
+  if (is_write(request)) {
+    invalidate(store.cache, request);
+  }
+  response.flags = status.ok() ? binary_success : 0;
+  append_binary_frame(out, response, {});
+}
+
+/**
+ ** It reads the request of the frame at offset of frames.
+ **
+ ** @return the size of the frame, or 0 if no frame is left
+ **/
+auto parse_frame(std::string_view frames, size_t offset,
+                 server::server_msg &request) -> size_t {
+  if (frames.size() - offset < length_size_field) {
+    return 0;
+  }
+  auto size = convert_byte_array_to_int(frames.data() + offset);
+  request.ParseFromArray(frames.data() + offset + length_size_field,
+                         static_cast<int>(size));
+  return length_size_field + size;
+}
+
+auto parse_frame(std::string_view frames, size_t offset,
+                 BinaryRequest &request) -> size_t {
+  if (frames.size() - offset < sizeof(BinaryHeader)) {
+    return 0;
+  }
+  request.header = read_binary_header(frames.data() + offset);
+  request.value = rocksdb::Slice(frames.data() + offset + sizeof(BinaryHeader),
+                                 request.header.value_size);
+  return sizeof(BinaryHeader) + request.header.value_size;
+}
+
+/* It runs a read request, whose frame is frame. */
+auto run_read(Store const &store, server::server_msg const & /*request*/,
+              std::string_view frame, std::string &out) -> void {
+  handle_request(store, frame.data() + length_size_field,
+                 frame.size() - length_size_field, out);
+}
+
+auto run_read(Store const &store, BinaryRequest const &request,
+              std::string_view /*frame*/, std::string &out) -> void {
+  handle_binary_request(store, request, out);
+}
+
+/* It appends the response of a write request once it is committed. */
+auto answer_write(server::server_msg const &request,
+                  rocksdb::Status const &status, std::string &out) -> void {
+  /* Delete comes from the master and does not require a response */
+  if (request.operation() == server::server_msg::DELETE) {
+    return;
+  }
+  auto &response = response_message;
+  start_response(request, response);
+  response.set_success(status.ok());
+  append_serialized(out, response);
+}
+
+auto answer_write(BinaryRequest const &request, rocksdb::Status const &status,
+                  std::string &out) -> void {
+  auto response = start_response(request);
+  response.flags = status.ok() ? binary_success : 0;
+  append_binary_frame(out, response, {});
+}
+
+/* @return true if the request may run in any batch of a split */
+auto pipelinable(server::server_msg const &request) -> bool {
+  return request.IsInitialized() && request.has_request_id() &&
+         is_single_key(request);
+}
+
+auto pipelinable(BinaryRequest const & /*request*/) -> bool { return true; }
+
+auto runs_apart(BinaryRequest const & /*request*/) -> bool { return false; }
+
+auto request_key(server::server_msg const &request) -> int32_t {
+  return request.key();
+}
+
+auto request_key(BinaryRequest const &request) -> int32_t {
+  return request.header.key;
+}
+
+/**
+ ** The requests of one batch of frames on their way through the group
+ ** commit, or off the thread for a BOOTSTRAP_SEND. A write leaves for the
+ ** commit thread, which appends its response once it is committed; any
+ ** other request waits until all earlier writes of the batch are answered.
+ ** The commit thread calls back in the order of the writes, so the
+ ** responses land in request order without a slot per request. A
+ ** BOOTSTRAP_SEND runs on a thread of its own and the batch waits for it.
+ ** The commit and transfer threads only answer their requests; once the
+ ** last outstanding one is, the run goes on in a task handed to schedule,
+ ** so a slow read or SCAN never holds up the commits of other connections.
+ ** Request is server::server_msg or BinaryRequest.
+ **/
+template <typename Request>
+class BatchRun : public std::enable_shared_from_this<BatchRun<Request>> {
+public:
+  /**
+   ** @param offset where in the frames of batch the run starts, after the
+   ** frames whose responses batch already holds
+   **/
+  BatchRun(Store const &store, std::unique_ptr<Batch> &&batch, size_t offset,
+           Reply const &reply, Schedule const &schedule)
+      : store(store), batch(std::move(batch)), offset(offset), reply(reply),
+        schedule(schedule) {}
+
+  auto resume() -> void {
+    Request request;
+    auto &frames = batch->frames;
+    while (auto frame_size = parse_frame(frames, offset, request)) {
+      bool deferred = store.committer != nullptr && is_write(request);
+      if (deferred && admit(store, request)) {
+        commit(request);
+        offset += frame_size;
+        continue;
+      }
+      /* Without outstanding requests no other thread appends responses */
+      if (!pause_for_commits()) {
+        return;
+      }
+      if (runs_apart(request)) {
+        /* The transfer may resume the run before transfer() returns */
+        offset += frame_size;
+        transfer(offset - frame_size);
+        return;
+      }
+      if (deferred) {
+        reject(store, request, batch->responses);
+      } else {
+        run_read(store, request,
+                 std::string_view(frames).substr(offset, frame_size),
+                 batch->responses);
+      }
+      offset += frame_size;
+    }
+    if (!pause_for_commits()) {
+      return;
+    }
+    reply(std::move(batch));
+  }
+
+private:
+  /* @return false if requests are outstanding; the last answer resumes */
+  auto pause_for_commits() -> bool {
+    std::lock_guard l(lock);
+    paused = outstanding > 0;
+    return !paused;
+  }
+
+  /* It counts a request in; the run stays alive until all are answered. */
+  auto hold() -> void {
+    if (outstanding++ == 0) {
+      pinned = this->shared_from_this();
+    }
+  }
+
+  /**
+   ** It appends the response of the oldest outstanding request with
+   ** append(responses); the last one resumes the run if it is paused.
+   **/
+  template <typename Append> auto answer(Append const &append) -> void {
+    std::shared_ptr<BatchRun> self;
+    bool resume;
+    {
+      std::lock_guard l(lock);
+      append(batch->responses);
+      resume = --outstanding == 0 && paused;
+      paused = paused && !resume;
+      if (outstanding == 0) {
+        self = std::move(pinned);
+      }
+    }
+    if (resume) {
+      /* The run may end before schedule returns */
+      auto schedule = this->schedule;
+      schedule([self = std::move(self)] { self->resume(); });
+    }
+  }
+
+  /* It runs the BOOTSTRAP_SEND at frame_offset and pauses until it ends. */
+  auto transfer(size_t frame_offset) -> void {
+    {
+      std::lock_guard l(lock);
+      hold();
+      paused = true;
+    }
+    std::thread([this, frame_offset] {
+      server::server_msg request;
+      parse_frame(batch->frames, frame_offset, request);
+      std::string framed;
+      run_transfer(store, request, framed);
+      answer([&framed](std::string &out) { out.append(framed); });
+    }).detach();
+  }
+
+  /**
+   ** It hands a write to the group commit. The callback only holds the run
+   ** and the offset of the frame, which it parses again on the commit
+   ** thread, so it fits into a GroupCommitter::Done without allocating.
+   **/
+  auto commit(Request const &request) -> void {
+    {
+      std::lock_guard l(lock);
+      hold();
+    }
+    store.committer->write(
+        [&request](rocksdb::WriteBatch &batch) { fill_batch(request, batch); },
+        [this, frame_offset = offset](rocksdb::Status const &status) {
+          thread_local Request written;
+          parse_frame(batch->frames, frame_offset, written);
+          invalidate(store.cache, written);
+          answer([&status](std::string &out) {
+            answer_write(written, status, out);
+          });
+        });
+  }
+
+  Store store;
+  std::unique_ptr<Batch> batch;
+  size_t offset;
+  Reply reply;
+  Schedule schedule;
+
+  std::mutex lock;
+  size_t outstanding{0}; // writes and transfers not answered yet
+  bool paused{false};
+  std::shared_ptr<BatchRun> pinned; // the run, while requests are outstanding
+};
+
+
+/**
+ ** It splits frames of complete frames like split_pipelined(), whose
+ ** requests are of type Request.
+ **/
+template <typename Request>
+auto split_frames(std::string_view frames, size_t nb_batches)
+    -> std::vector<std::string> {
+  std::vector<std::string> batches;
+  if (nb_batches < 2) {
+    return batches;
+  }
+  Request request;
+  size_t nb_frames = 0;
+  size_t offset = 0;
+  while (auto frame_size = parse_frame(frames, offset, request)) {
+    if (!pipelinable(request)) {
+      return {};
+    }
+    /* Only once it may split, so a batch that cannot costs no allocation */
+    if (batches.empty()) {
+      batches.resize(nb_batches);
+    }
+    auto &batch =
+        batches[std::hash<int32_t>{}(request_key(request)) % nb_batches];
+    batch.append(frames.substr(offset, frame_size));
+    offset += frame_size;
+    ++nb_frames;
+  }
+  if (nb_frames < 2) {
+    return {};
+  }
+  std::erase_if(batches, [](auto const &batch) { return batch.empty(); });
+  return batches;
+}
+
+} // namespace
+
+auto handle_request(Store const &store, const char *payload, size_t size,
+                    std::string &out) -> bool {
+  auto &request = request_message;
+  auto &response = response_message;
+  request.ParseFromArray(payload, static_cast<int>(size));
+  if (runs_apart(request)) {
+    return false;
+  }
+  if (!admit(store, request)) {
+    reject(store, request, out);
+    return true;
+  }
+  if (store.cache != nullptr &&
+      request.operation() == server::server_msg::GET) {
+    cached_get(store, request, response, out);
+    return true;
+  }
+  auto *engine = store.engine;
+  start_response(request, response);
+  auto key = encode_key(request.key());
+  if (request.operation() == server::server_msg::GET) {
+    rocksdb::PinnableSlice value(&read_buffer);
+    auto status = engine->get(key_slice(key), &value);
+    if (status.ok() && set_live_value(value, response)) {
+      response.set_success(true);
+    } else {
+      response.set_key_exists(false);
+      response.set_success(false);
+    }
+  } else if (request.operation() == server::server_msg::PUT) {
+    std::string scratch;
+    auto status = engine->put(key_slice(key), put_value(request, &scratch));
+    response.set_success(status.ok());
+  } else if (request.operation() == server::server_msg::DELETE) {
+    auto status = engine->remove(key_slice(key));
+    response.set_success(status.ok());
+  } else if (request.operation() == server::server_msg::MERGE) {
+    auto status = engine->merge(key_slice(key), counter_operand(request));
+    response.set_success(status.ok());
+  } else if (request.operation() == server::server_msg::MULTI_GET) {
+    multi_get(engine, request, response);
+  } else if (request.operation() == server::server_msg::MULTI_PUT) {
+    multi_put(engine, request, response);
+  } else if (request.operation() == server::server_msg::SCAN) {
+    scan(engine, request, response, out);
+    return true;
+  } else if (request.operation() == server::server_msg::KEYS) {
+    list_keys(engine, request, response, out);
+    return true;
+  } else if (request.operation() == server::server_msg::KEY_COUNT) {
+    count_keys(engine, request, response);
+    if (store.map != nullptr) {
+      response.set_nb_requests(
+          store.map->take_requests(request.key(), request.end_key()));
+    }
+  } else if (request.operation() == server::server_msg::MAP_VERSION) {
+    if (store.map != nullptr) {
+      store.map->publish(request.map_version(),
+                         {request.range_starts().begin(),
+                          request.range_starts().end()});
+    }
+    response.set_success(store.map != nullptr);
+  } else if (request.operation() == server::server_msg::LEAVE) {
+    response.set_success(leave(store, request));
+  } else if (request.operation() == server::server_msg::BOOTSTRAP_RECEIVE) {
+    auto port = receive_sst(store);
+    response.set_success(port.has_value());
+    if (port) {
+      response.set_peer_port(*port);
+    }
+  } else {
+    response.set_success(false);
+  }
+  if (is_write(request)) {
+    invalidate(store.cache, request);
+  }
+  /* Delete comes from the master and does not require a response */
+  if (request.operation() != server::server_msg::DELETE) {
+    append_serialized(out, response);
+  }
+  return true;
+}
+
+auto handle_requests(Store const &store, Encoding encoding, const char *frames,
+                     size_t size, std::string &out) -> size_t {
+  size_t offset = 0;
+  if (encoding == Encoding::binary) {
+    BinaryRequest request;
+    while (auto frame_size =
+               parse_frame(std::string_view(frames, size), offset, request)) {
+      handle_binary_request(store, request, out);
+      offset += frame_size;
+    }
+    return offset;
+  }
+  while (offset + length_size_field <= size) {
+    auto frame_size = convert_byte_array_to_int(frames + offset);
+    if (!handle_request(store, frames + offset + length_size_field,
+                        frame_size, out)) {
+      break;
+    }
+    offset += length_size_field + frame_size;
+  }
+  return offset;
+}
+
+auto handle_requests(Store const &store, std::unique_ptr<Batch> &&batch,
+                     Reply const &reply, Schedule const &schedule) -> void {
+  size_t offset = 0;
+  batch->responses.clear();
+  if (store.committer == nullptr) {
+    offset = handle_requests(store, batch->encoding, batch->frames.data(),
+                             batch->frames.size(), batch->responses);
+    if (offset == batch->frames.size()) {
+      reply(std::move(batch));
+      return;
+    }
+  }
+  if (batch->encoding == Encoding::binary) {
+    std::make_shared<BatchRun<BinaryRequest>>(store, std::move(batch), offset,
+                                              reply, schedule)
+        ->resume();
+    return;
+  }
+  std::make_shared<BatchRun<server::server_msg>>(store, std::move(batch),
+                                                 offset, reply, schedule)
+      ->resume();
+}
+
+auto split_pipelined(Encoding encoding, const char *frames, size_t size,
+                     size_t nb_batches) -> std::vector<std::string> {
+  if (encoding == Encoding::binary) {
+    return split_frames<BinaryRequest>(std::string_view(frames, size),
+                                       nb_batches);
+  }
+  return split_frames<server::server_msg>(std::string_view(frames, size),
+                                          nb_batches);
+}
@@ -0,0 +1,94 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "group_commit.h"
+#include "response_cache.h"
+#include "shard_map.h"
+#include "storage_engine.h"
+
+/**
+ ** Everything the requests of one shard run against.
+ **/
+struct Store {
+  StorageEngine *engine;
+  GroupCommitter *committer{nullptr}; // nullptr writes every request on its own
+  ResponseCache *cache{nullptr};      // nullptr reads every GET from engine
+  ShardMapState *map{nullptr};        // nullptr runs every request of any map
+};
+
+/**
+ ** The encoding of the frames of a connection: length-prefixed server_msg
+ ** frames, or the frames of binary_protocol.h.
+ **/
+enum class Encoding { protobuf, binary };
+
+/**
+ ** A batch of complete request frames of one connection and the framed
+ ** responses to them. It goes back to its connection with the responses,
+ ** which keeps both buffers for its next batch.
+ **/
+struct Batch {
+  uint64_t conn_id{0};
+  Encoding encoding{Encoding::protobuf};
+  std::string frames;
+  std::string responses;
+};
+
+using Reply = std::function<void(std::unique_ptr<Batch> &&batch)>;
+using Task = std::function<void()>;
+/* It runs a task later, on a thread that runs requests. */
+using Schedule = std::function<void(Task &&task)>;
+
+/**
+ ** It runs one serialized server::server_msg request against the KV store and
+ ** appends the framed response, if the operation has one, to out.
+ **
+ ** @return false, without running it, for a BOOTSTRAP_SEND: it holds its
+ ** thread for a whole SST transfer and only runs on a thread of its own
+ ** through the other handle_requests()
+ **/
+auto handle_request(Store const &store, const char *payload, size_t size,
+                    std::string &out) -> bool;
+
+/**
+ ** It runs, in order, the requests of a buffer that holds only complete
+ ** frames of encoding (see complete_frames() and complete_binary_frames()),
+ ** up to the first that handle_request() does not run.
+ **
+ ** @return the bytes of the frames it ran
+ **/
+auto handle_requests(Store const &store, Encoding encoding, const char *frames,
+                     size_t size, std::string &out) -> size_t;
+
+/**
+ ** It runs the requests of batch like handle_requests() and calls reply with
+ ** the batch and their framed responses. Without a group committer or a
+ ** BOOTSTRAP_SEND reply is called before it returns. With one, the writes go through the group
+ ** commit and are only answered once they are durable; the requests after a
+ ** write wait for its commit, so they see it. A BOOTSTRAP_SEND runs on a
+ ** thread of its own and the requests after it wait for its end. The commit
+ ** and transfer threads only answer their requests: the requests after them,
+ ** and reply, run in a task handed to schedule.
+ **/
+auto handle_requests(Store const &store, std::unique_ptr<Batch> &&batch,
+                     Reply const &reply, Schedule const &schedule) -> void;
+
+/**
+ ** It splits a buffer of complete frames into at most nb_batches batches that
+ ** can run concurrently, with all requests on one key in the same batch and
+ ** in their original order. That is only allowed if every request carries a
+ ** request id, since the responses of different batches come back in any
+ ** order, and touches a single key. Binary requests always do.
+ **
+ ** @return no batch if a request has no request id or is a MULTI_GET or
+ ** MULTI_PUT, or if there is nothing to split; the buffer then has to run as
+ ** one batch
+ **/
+auto split_pipelined(Encoding encoding, const char *frames, size_t size,
+                     size_t nb_batches) -> std::vector<std::string>;
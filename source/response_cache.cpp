@@ -0,0 +1,155 @@
+#include <functional>
+
+#include "response_cache.h"
+
+#include "shared.h"
+
+namespace {
+
+/* Bookkeeping bytes of an entry on top of its payload. */
+constexpr size_t entry_overhead = 64;
+
+/* Tag of server_msg.request_id (field 6, varint). */
+constexpr char request_id_tag = 6 << 3;
+
+auto append_varint(std::string &out, uint64_t value) -> void {
+  while (value >= 0x80) {
+    out.push_back(static_cast<char>(value | 0x80));
+    value >>= 7;
+  }
+  out.push_back(static_cast<char>(value));
+}
+
+} // namespace
+
+ResponseCache::ResponseCache(size_t capacity_bytes)
+    : segment_capacity(capacity_bytes / nb_segments) {}
+
+auto ResponseCache::segment(int32_t key) -> Segment & {
+  return segments[std::hash<int32_t>{}(key) % nb_segments];
+}
+
+auto ResponseCache::cost(Entry const &entry) -> size_t {
+  return entry.payload.size() + entry_overhead;
+}
+
+auto ResponseCache::append_response(std::string &out, std::string_view payload,
+                                    std::optional<uint64_t> request_id)
+    -> void {
+  if (!request_id) {
+    append_message(out, payload);
+    return;
+  }
+  std::string suffix(1, request_id_tag);
+  append_varint(suffix, *request_id);
+  auto offset = out.size();
+  out.resize(offset + length_size_field);
+  convert_int_to_byte_array(out.data() + offset,
+                            payload.size() + suffix.size());
+  out.append(payload);
+  out.append(suffix);
+}
+
+auto ResponseCache::lookup(int32_t key, std::optional<uint64_t> request_id,
+                           std::string &out) -> bool {
+  auto &seg = segment(key);
+  std::lock_guard l(seg.lock);
+  auto it = seg.index.find(key);
+  if (it == seg.index.end()) {
+    return false;
+  }
+  auto &entry = seg.slots[it->second];
+  entry.referenced = true;
+  append_response(out, entry.payload, request_id);
+  return true;
+}
+
+auto ResponseCache::ticket(int32_t key) -> Ticket {
+  auto &seg = segment(key);
+  std::lock_guard l(seg.lock);
+  return seg.version;
+}
+
+auto ResponseCache::fill(int32_t key, Ticket ticket, std::string_view payload)
+    -> void {
+  auto &seg = segment(key);
+  std::lock_guard l(seg.lock);
+  if (seg.version != ticket || payload.size() + entry_overhead >
+                                   segment_capacity) {
+    return;
+  }
+  if (auto it = seg.index.find(key); it != seg.index.end()) {
+    auto &entry = seg.slots[it->second];
+    seg.bytes -= cost(entry);
+    entry.payload.assign(payload);
+    seg.bytes += cost(entry);
+    return;
+  }
+  while (seg.bytes + payload.size() + entry_overhead > segment_capacity) {
+    evict_one(seg);
+  }
+  size_t pos;
+  if (seg.free_slots.empty()) {
+    pos = seg.slots.size();
+    seg.slots.emplace_back();
+  } else {
+    pos = seg.free_slots.back();
+    seg.free_slots.pop_back();
+  }
+  auto &entry = seg.slots[pos];
+  entry.key = key;
+  entry.payload.assign(payload);
+  entry.referenced = false;
+  seg.bytes += cost(entry);
+  seg.index.emplace(key, pos);
+}
+
+/* CLOCK: the hand clears referenced bits until it finds an entry without. */
+auto ResponseCache::evict_one(Segment &seg) -> void {
+  while (true) {
+    seg.hand = (seg.hand + 1) % seg.slots.size();
+    auto &entry = seg.slots[seg.hand];
+    auto it = seg.index.find(entry.key);
+    if (it == seg.index.end() || it->second != seg.hand) {
+      continue; // a free slot
+    }
+    if (entry.referenced) {
+      entry.referenced = false;
+      continue;
+    }
+    seg.bytes -= cost(entry);
+    seg.index.erase(it);
+    entry.payload.clear();
+    entry.payload.shrink_to_fit();
+    seg.free_slots.push_back(seg.hand);
+    return;
+  }
+}
+
+auto ResponseCache::invalidate(int32_t key) -> void {
+  auto &seg = segment(key);
+  std::lock_guard l(seg.lock);
+  ++seg.version;
+  auto it = seg.index.find(key);
+  if (it == seg.index.end()) {
+    return;
+  }
+  auto &entry = seg.slots[it->second];
+  seg.bytes -= cost(entry);
+  entry.payload.clear();
+  entry.payload.shrink_to_fit();
+  seg.free_slots.push_back(it->second);
+  seg.index.erase(it);
+}
+
+auto ResponseCache::invalidate_all() -> void {
+  for (auto &seg : segments) {
+    std::lock_guard l(seg.lock);
+    ++seg.version;
+    seg.index.clear();
+    seg.slots.clear();
+    seg.free_slots.clear();
+    seg.hand = 0;
+    seg.bytes = 0;
+  }
+}
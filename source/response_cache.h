@@ -0,0 +1,87 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+/**
+ ** Cache of the serialized GET responses of hot keys.
+ **
+ ** An entry is the server_msg payload of a GET response without its
+ ** request_id, so a hit is answered with a copy of the bytes and neither
+ ** touches RocksDB nor runs protobuf. The entries live in independently
+ ** locked segments by key; each segment evicts with CLOCK within its share
+ ** of the byte budget.
+ **
+ ** A write must invalidate its keys after it reached RocksDB and before it is
+ ** acknowledged. A miss takes a ticket before reading RocksDB and hands it to
+ ** fill(), which drops the response if a write invalidated the segment in
+ ** between, so a fill never brings back a value older than a write.
+ **/
+class ResponseCache {
+public:
+  using Ticket = uint64_t;
+
+  explicit ResponseCache(size_t capacity_bytes);
+
+  /**
+   ** It appends the framed response of key, with request_id if there is one,
+   ** to out.
+   **
+   ** @return false on a miss
+   **/
+  auto lookup(int32_t key, std::optional<uint64_t> request_id,
+              std::string &out) -> bool;
+
+  [[nodiscard]] auto ticket(int32_t key) -> Ticket;
+
+  /**
+   ** It caches the response payload of key, unless key's segment was
+   ** invalidated since the ticket was taken.
+   **/
+  auto fill(int32_t key, Ticket ticket, std::string_view payload) -> void;
+
+  auto invalidate(int32_t key) -> void;
+
+  /* It invalidates every key, for writes whose keys are not known. */
+  auto invalidate_all() -> void;
+
+  /**
+   ** It appends the frame of a GET response payload, adding request_id if
+   ** there is one, to out. Since request_id is the highest field of a GET
+   ** response, the result is the same as serializing the response with it.
+   **/
+  static auto append_response(std::string &out, std::string_view payload,
+                              std::optional<uint64_t> request_id) -> void;
+
+private:
+  static constexpr size_t nb_segments = 16;
+
+  struct Entry {
+    int32_t key{0};
+    std::string payload;
+    bool referenced{false};
+  };
+
+  struct Segment {
+    std::mutex lock;
+    std::unordered_map<int32_t, size_t> index; // key -> position in slots
+    std::vector<Entry> slots;
+    std::vector<size_t> free_slots;
+    size_t hand{0};
+    size_t bytes{0};
+    Ticket version{0}; // bumped by every invalidation
+  };
+
+  auto segment(int32_t key) -> Segment &;
+  auto evict_one(Segment &seg) -> void;
+  static auto cost(Entry const &entry) -> size_t;
+
+  size_t segment_capacity;
+  std::array<Segment, nb_segments> segments;
+};
@@ -0,0 +1,107 @@
+#include <fstream>
+#include <memory>
+
+#include "rocksdb_profiles.h"
+
+#include "counter_merge.h"
+#include "key_encoding.h"
+#include "rocksdb/cache.h"
+#include "rocksdb/convenience.h"
+#include "rocksdb/filter_policy.h"
+#include "rocksdb/slice_transform.h"
+#include "rocksdb/table.h"
+#include "value_ttl.h"
+
+namespace {
+
+/**
+ ** Stateless, so all KV stores share it. It is never destroyed, as a
+ ** background compaction may still run while the server exits.
+ **/
+auto ttl_filter() -> rocksdb::CompactionFilter const * {
+  static auto const *filter = new TtlCompactionFilter();
+  return filter;
+}
+
+/* The options of the server before there were profiles. */
+auto legacy_options() -> rocksdb::Options {
+  rocksdb::Options options;
+  options.IncreaseParallelism();
+  options.OptimizeLevelStyleCompaction();
+  options.create_if_missing = true;
+  options.compression_per_level.assign(options.num_levels,
+                                       rocksdb::kNoCompression);
+  options.compression = rocksdb::kNoCompression;
+  options.merge_operator = std::make_shared<CounterMergeOperator>();
+  options.compaction_filter = ttl_filter();
+  return options;
+}
+
+auto filtered_table(std::shared_ptr<rocksdb::Cache> const &cache,
+                    int bloom_bits_per_key)
+    -> rocksdb::BlockBasedTableOptions {
+  rocksdb::BlockBasedTableOptions table;
+  table.block_cache = cache;
+  /* false builds one full filter per SST file instead of one per block. */
+  table.filter_policy.reset(
+      rocksdb::NewBloomFilterPolicy(bloom_bits_per_key, false));
+  table.whole_key_filtering = true;
+  table.cache_index_and_filter_blocks = true;
+  table.pin_l0_filter_and_index_blocks_in_cache = true;
+  return table;
+}
+
+/* Every key is its own prefix; format_key is the only longer key. */
+auto use_hash_index(rocksdb::Options &options,
+                    rocksdb::BlockBasedTableOptions &table) -> void {
+  options.prefix_extractor.reset(
+      rocksdb::NewFixedPrefixTransform(encoded_key_size));
+  table.index_type = rocksdb::BlockBasedTableOptions::kHashSearch;
+}
+
+} // namespace
+
+auto rocksdb_profile(std::string_view profile, size_t block_cache_bytes)
+    -> std::optional<rocksdb::Options> {
+  auto options = legacy_options();
+  if (profile == "legacy") {
+    return options;
+  }
+  auto cache = rocksdb::NewLRUCache(block_cache_bytes);
+  rocksdb::BlockBasedTableOptions table;
+  if (profile == "balanced") {
+    table = filtered_table(cache, 10);
+    use_hash_index(options, table);
+  } else if (profile == "point-lookup") {
+    table = filtered_table(cache, 16);
+    use_hash_index(options, table);
+    options.memtable_prefix_bloom_size_ratio = 0.1;
+  } else if (profile == "write-heavy") {
+    table = filtered_table(cache, 10);
+    options.write_buffer_size = 128 << 20;
+    options.max_write_buffer_number = 4;
+    options.min_write_buffer_number_to_merge = 2;
+    options.level0_file_num_compaction_trigger = 8;
+  } else {
+    return std::nullopt;
+  }
+  options.table_factory.reset(rocksdb::NewBlockBasedTableFactory(table));
+  return options;
+}
+
+auto apply_options_file(std::string const &path, rocksdb::Options &options)
+    -> rocksdb::Status {
+  std::ifstream file(path);
+  if (!file) {
+    return rocksdb::Status::IOError("cannot read " + path);
+  }
+  std::string settings;
+  std::string line;
+  while (std::getline(file, line)) {
+    if (!line.empty() && line[0] != '#') {
+      settings.append(line).push_back(';');
+    }
+  }
+  auto base = options;
+  return rocksdb::GetOptionsFromString(base, settings, &options);
+}
@@ -0,0 +1,48 @@
+#pragma once
+
+#include <cstddef>
+#include <optional>
+#include <string>
+#include <string_view>
+
+#include "rocksdb/options.h"
+#include "rocksdb/status.h"
+
+/**
+ ** Named tunings of the RocksDB engine.
+ **
+ **  - legacy: the options the server always used, without filters or a sized
+ **    block cache.
+ **  - balanced: full bloom filters, so a GET of a missing key skips the SST
+ **    files instead of walking every level, a hash index on the fixed-width
+ **    key prefix, and index and filter blocks in the block cache with the
+ **    ones of L0 pinned.
+ **  - point-lookup: balanced plus a prefix bloom in the memtable and more
+ **    bits per key.
+ **  - write-heavy: the filters and the block cache of balanced with a binary
+ **    search index, larger memtables and later L0 compactions.
+ **
+ ** The profiles share one block cache of block_cache_bytes, so all KV stores
+ ** of a server stay within one budget. All of them install the
+ ** CounterMergeOperator and the TtlCompactionFilter.
+ **/
+
+inline constexpr std::string_view default_rocksdb_profile{"balanced"};
+inline constexpr std::string_view rocksdb_profile_names{
+    "legacy, balanced, point-lookup, write-heavy"};
+
+/**
+ ** It builds the options of profile, with create_if_missing set.
+ **
+ ** @return nothing for an unknown profile
+ **/
+auto rocksdb_profile(std::string_view profile, size_t block_cache_bytes)
+    -> std::optional<rocksdb::Options>;
+
+/**
+ ** It applies the RocksDB options string in the file at path to options. The
+ ** file holds one `name=value` per line, like `write_buffer_size=67108864`;
+ ** empty lines and lines starting with # are skipped.
+ **/
+auto apply_options_file(std::string const &path, rocksdb::Options &options)
+    -> rocksdb::Status;
@@ -20,11 +20,44 @@
 #include <google/protobuf/io/zero_copy_stream_impl.h>
 #include <google/protobuf/text_format.h>
 #include "rocksdb/db.h"
+#include "group_commit.h"
+#include "key_encoding.h"
+#include "memory_engine.h"
+#include "response_cache.h"
+#include "rocksdb_profiles.h"
+#include "shard_map.h"
+#include "storage_engine.h"
+#include "server_thread.h"
+#include "uring_thread.h"
+#include <algorithm>
+#include <chrono>
+#include <csignal>
+#include <filesystem>
+#include <thread>
+#include <vector>
 
 const char *hostname = "localhost";
 
 std::atomic<int64_t> number{0};
 
+/* The configuration of the server from the command line. */
+struct ServerConfig
+{
+    int port;
+    int master_port;
+    size_t io_threads;
+    size_t worker_threads;
+    size_t cores; /* 0 unless in shard-per-core mode */
+    bool use_uring;
+    bool in_memory; /* the memory engine instead of RocksDB */
+    rocksdb::Options db_options; /* of the RocksDB engine, shared by all its instances */
+    std::string data_dir;        /* empty for a new ./db<pid> on every start */
+    std::chrono::microseconds group_commit_window; /* 0 disables group commit */
+    size_t group_commit_bytes;
+    size_t cache_bytes; /* 0 disables the response cache */
+    uint32_t weight;    /* relative capacity, reported to the master on joining */
+};
+
 /**
  * It prints an error message and exits the program
  *
@@ -36,35 +69,256 @@ void error(const char *msg)
     exit(0);
 }
 
-int main(int argc, char *argv[])
+/**
+ * It opens (or creates) the local KV store at db_path.
+ *
+ * @param db_path the directory of the RocksDB instance
+ * @param opts the options of the selected tuning profile
+ *
+ * @return the opened database
+ */
+rocksdb::DB *open_db(const std::string &db_path, const rocksdb::Options &opts)
 {
-    /* Creating a local KV store. */
     rocksdb::DB *db;
-    rocksdb::Options opts;
-    // Optimize RocksDB. This is the easiest way to get RocksDB to perform well
-    opts.IncreaseParallelism();
-    opts.OptimizeLevelStyleCompaction();
-    // create the DB if it's not already present
-    opts.create_if_missing = true;
-    opts.compression_per_level.resize(opts.num_levels);
-#if 1
-    for (int i = 0; i < opts.num_levels; i++)
-    {
-        opts.compression_per_level[i] = rocksdb::kNoCompression;
-    }
-#endif
-    opts.compression = rocksdb::kNoCompression;
-    std::string db_path = "./db" + std::to_string(getpid());
     rocksdb::Status status = rocksdb::DB::Open(opts, db_path, &db);
+    if (!status.ok())
+    {
+        fmt::print(stderr, "Cannot open the database at {}: {}\n", db_path, status.ToString());
+        exit(1);
+    }
+
+    /* A new database records the key encoding it is written with, an old one must be migrated first */
+    int format = read_format(db);
+    if (format == 0)
+    {
+        write_format(db, current_format);
+    }
+    else if (format != current_format)
+    {
+        fmt::print(stderr, "The database at {} has format {} instead of {}, run kv-migrate on it first\n", db_path, format, current_format);
+        exit(1);
+    }
+    return db;
+}
+
+/**
+ * It creates the storage engine of one KV store.
+ *
+ * @param db_path the directory of the RocksDB instance, unused by the memory engine
+ */
+std::unique_ptr<StorageEngine> make_engine(const ServerConfig &config, const std::string &db_path)
+{
+    if (config.in_memory)
+    {
+        return std::make_unique<MemoryEngine>();
+    }
+    return std::make_unique<RocksDbEngine>(open_db(db_path, config.db_options));
+}
+
+/**
+ * It sends the join message of the shard listening at port to the master.
+ *
+ * @param master_port the port of the master
+ * @param port the port at which the joining shard listens
+ * @param weight the relative capacity of the shard, for the weighted placements
+ */
+void join_cluster(int master_port, int port, uint32_t weight)
+{
+    int masterfd = connect_socket(hostname, master_port);
+    if (masterfd < 0)
+    {
+        error("Error connecting to the master");
+    }
+
+    /* Create join message to the master */
+    sockets::master_msg master_msg;
+    master_msg.set_operation(sockets::master_msg::SERVER_JOIN);
+    master_msg.set_server_port(port);
+    master_msg.set_weight(weight);
+    /* Send the join message */
+    std::string join_str;
+    master_msg.SerializeToString(&join_str);
+    auto msg_size = join_str.size();
+    auto buf = std::make_unique<char[]>(msg_size + length_size_field);
+    construct_message(buf.get(), join_str.c_str(), msg_size);
+    secure_send(masterfd, buf.get(), msg_size + length_size_field);
+    close(masterfd);
+}
+
+/**
+ * It creates a non-blocking listening socket at port.
+ */
+int open_listener(int port, bool reuse_port)
+{
+    /* This is creating a socket and checking if it is valid. */
+    int sockfd = listening_socket(port, reuse_port);
+    if (sockfd < 0)
+    {
+        error("Error creating socket");
+    }
+    if (set_nonblocking(sockfd) < 0)
+    {
+        error("Error setting the listening socket non-blocking");
+    }
+    return sockfd;
+}
+
+/**
+ * It creates an I/O thread of the selected transport.
+ */
+std::unique_ptr<ServerLoop> make_loop(const ServerConfig &config, int sockfd, const Store &store,
+                                      WorkerPool *workers)
+{
+    if (config.use_uring)
+    {
+        return std::make_unique<UringThread>(sockfd, store, workers);
+    }
+    return std::make_unique<IoThread>(sockfd, store, workers);
+}
+
+/**
+ * It creates the group committer of engine, or none if group commit is disabled.
+ */
+std::unique_ptr<GroupCommitter> make_committer(const ServerConfig &config, StorageEngine *engine)
+{
+    if (config.group_commit_window.count() == 0)
+    {
+        return nullptr;
+    }
+    return std::make_unique<GroupCommitter>(engine, config.group_commit_window, config.group_commit_bytes);
+}
+
+/**
+ * It creates the response cache of one KV store, or none if it is disabled.
+ */
+std::unique_ptr<ResponseCache> make_cache(const ServerConfig &config)
+{
+    if (config.cache_bytes == 0)
+    {
+        return nullptr;
+    }
+    return std::make_unique<ResponseCache>(config.cache_bytes);
+}
 
-    assert(status.ok());
+/**
+ * It runs one shard on all threads: the I/O threads share one listening
+ * socket and the worker pool shares one RocksDB instance.
+ */
+void run_shared(const ServerConfig &config)
+{
+    auto engine = make_engine(config, config.data_dir.empty() ? "./db" + std::to_string(getpid()) : config.data_dir);
+    /* The socket already queues connections: the master lists the keys kept in the data directory during the join. */
+    int sockfd = open_listener(config.port, false);
+    join_cluster(config.master_port, config.port, config.weight);
+
+    /* The worker pool runs the requests; without it the I/O threads do. */
+    std::unique_ptr<WorkerPool> workers;
+    if (config.worker_threads > 0)
+    {
+        workers = std::make_unique<WorkerPool>(config.worker_threads);
+    }
+    auto committer = make_committer(config, engine.get());
+    auto cache = make_cache(config);
+    ShardMapState map;
+    Store store{engine.get(), committer.get(), cache.get(), &map};
+
+    /* Every I/O thread accepts from the shared listening socket and serves the connections it accepted. */
+    std::vector<std::unique_ptr<ServerLoop>> io_loops;
+    for (size_t i = 0; i < config.io_threads; i++)
+    {
+        io_loops.push_back(make_loop(config, sockfd, store, workers.get()));
+    }
+    std::vector<std::thread> threads;
+    for (size_t i = 1; i < config.io_threads; i++)
+    {
+        threads.emplace_back(&ServerLoop::run, io_loops[i].get());
+    }
+    io_loops[0]->run();
+
+    for (auto &thread : threads)
+    {
+        thread.join();
+    }
+
+    /* Closing the sockets. */
+    close(sockfd);
+}
 
+/**
+ * It runs one logical shard per core. Reactor i is pinned to core i, listens
+ * at port + i and owns its own RocksDB instance, so the reactors share no
+ * locks and no memtable. Every reactor joins the cluster as its own shard.
+ */
+void run_shard_per_core(const ServerConfig &config)
+{
+    auto nb_cpus = std::max(std::thread::hardware_concurrency(), 1U);
+    std::vector<std::unique_ptr<StorageEngine>> engines;
+    std::vector<std::unique_ptr<GroupCommitter>> committers;
+    std::vector<std::unique_ptr<ResponseCache>> caches;
+    std::vector<std::unique_ptr<ShardMapState>> maps;
+    std::vector<std::unique_ptr<ServerLoop>> reactors;
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i < config.cores; i++)
+    {
+        int shard_port = config.port + static_cast<int>(i);
+        std::string db_path = config.data_dir.empty() ? "./db" + std::to_string(getpid()) + "-" + std::to_string(i)
+                                                      : config.data_dir + "/shard-" + std::to_string(i);
+        engines.push_back(make_engine(config, db_path));
+        int sockfd = open_listener(shard_port, true);
+        committers.push_back(make_committer(config, engines.back().get()));
+        caches.push_back(make_cache(config));
+        maps.push_back(std::make_unique<ShardMapState>());
+        Store store{engines.back().get(), committers.back().get(), caches.back().get(), maps.back().get()};
+        reactors.push_back(make_loop(config, sockfd, store, nullptr));
+        threads.emplace_back(&ServerLoop::run, reactors.back().get());
+        if (!pin_to_core(threads.back(), i % nb_cpus))
+        {
+            fmt::print(stderr, "Could not pin the reactor of port {} to core {}\n", shard_port, i % nb_cpus);
+        }
+        /* The reactor serves before it joins: the master may move keys to it right away. */
+        join_cluster(config.master_port, shard_port, config.weight);
+    }
+
+    for (auto &thread : threads)
+    {
+        thread.join();
+    }
+}
+
+int main(int argc, char *argv[])
+{
     /* This is parsing the command line arguments. */
     cxxopts::Options options(argv[0], "Sever for the sockets benchmark");
     options.allow_unrecognised_options().add_options()(
         "p,port", "Port at which the server listens to.",
         cxxopts::value<size_t>())("m,masterport", "Port of the master server",
-                                  cxxopts::value<std::size_t>())("h,help", "Print help");
+                                  cxxopts::value<std::size_t>())(
+        "io-threads", "Number of threads that own the client connections.",
+        cxxopts::value<std::size_t>()->default_value("1"))(
+        "worker-threads", "Number of threads that run the requests on the KV store; 0 runs them on the I/O threads.",
+        cxxopts::value<std::size_t>()->default_value(std::to_string(std::thread::hardware_concurrency())))(
+        "shard-per-core", "Run this many pinned reactors, each a shard of its own at PORT + i with its own KV store; 0 disables the mode.",
+        cxxopts::value<std::size_t>()->default_value("0"))(
+        "transport", "Network transport: epoll or io_uring. io_uring falls back to epoll on kernels without support.",
+        cxxopts::value<std::string>()->default_value("epoll"))(
+        "group-commit-us", "Collect the writes of this many microseconds into one synced WriteBatch before acknowledging them; 0 writes every request on its own, unsynced.",
+        cxxopts::value<std::size_t>()->default_value("0"))(
+        "group-commit-bytes", "Commit a group early once its WriteBatch holds this many bytes.",
+        cxxopts::value<std::size_t>()->default_value(std::to_string(1 << 20)))(
+        "cache-bytes", "Cache the GET responses of hot keys in this many bytes per KV store; 0 disables the cache.",
+        cxxopts::value<std::size_t>()->default_value("0"))(
+        "engine", "Storage engine of the KV store: rocksdb, or memory for a cache tier that keeps nothing across restarts.",
+        cxxopts::value<std::string>()->default_value("rocksdb"))(
+        "rocksdb-profile", fmt::format("Tuning profile of the RocksDB engine: {}.", rocksdb_profile_names),
+        cxxopts::value<std::string>()->default_value(std::string(default_rocksdb_profile)))(
+        "block-cache-bytes", "Size of the block cache that all RocksDB instances of the server share.",
+        cxxopts::value<std::size_t>()->default_value(std::to_string(64 << 20)))(
+        "rocksdb-options", "File of RocksDB options, one name=value per line, applied on top of the profile.",
+        cxxopts::value<std::string>())(
+        "data-dir", "Directory of the KV store that is reopened on restart; without it every start uses a new ./db<pid>.",
+        cxxopts::value<std::string>())(
+        "weight", "Relative capacity of the server: with the ring or rendezvous placement of the master it gets about this many times the keys of a server of weight 1.",
+        cxxopts::value<std::size_t>()->default_value("1"))("h,help", "Print help");
 
     auto args = options.parse(argc, argv);
     if (args.count("help"))
@@ -88,122 +342,72 @@ int main(int argc, char *argv[])
     }
 
     /* This is converting the arguments into integers. */
-    int port = args["port"].as<size_t>();
-    int master_port = args["masterport"].as<size_t>();
-    int masterfd = connect_socket(hostname, master_port);
-
-    /* Create join message to the master */
-    sockets::master_msg master_msg;
-    master_msg.set_operation(sockets::master_msg::SERVER_JOIN);
-    master_msg.set_server_port(port);
-    /* Send the join message */
-    std::string join_str;
-    master_msg.SerializeToString(&join_str);
-    auto msg_size = join_str.size();
-    auto buf = std::make_unique<char[]>(msg_size + length_size_field);
-    construct_message(buf.get(), join_str.c_str(), msg_size);
-    secure_send(masterfd, buf.get(), msg_size + length_size_field);
-    
-
-    
-    /* This is creating a socket and checking if it is valid. */
-    int sockfd = listening_socket(port);
-    if (sockfd < 0)
+    ServerConfig config;
+    config.port = args["port"].as<size_t>();
+    config.master_port = args["masterport"].as<size_t>();
+    config.io_threads = std::max<size_t>(args["io-threads"].as<size_t>(), 1);
+    config.worker_threads = args["worker-threads"].as<size_t>();
+    config.cores = args["shard-per-core"].as<size_t>();
+    config.group_commit_window = std::chrono::microseconds(args["group-commit-us"].as<size_t>());
+    config.group_commit_bytes = args["group-commit-bytes"].as<size_t>();
+    config.cache_bytes = args["cache-bytes"].as<size_t>();
+    config.weight = std::clamp<size_t>(args["weight"].as<size_t>(), 1, 1024);
+    std::string transport = args["transport"].as<std::string>();
+    if (transport != "epoll" && transport != "io_uring")
     {
-        error("Error creating socket");
+        fmt::print(stderr, "Unknown transport {}\n{}\n", transport, options.help());
+        return 1;
     }
-
-    /* This is accepting the connection from the client. */
-    int newsockfd = accept_connection(sockfd);
-    if (newsockfd < 0)
+    config.use_uring = transport == "io_uring";
+    std::string engine = args["engine"].as<std::string>();
+    if (engine != "rocksdb" && engine != "memory")
     {
-        error("Error accepting connection.");
+        fmt::print(stderr, "Unknown engine {}\n{}\n", engine, options.help());
+        return 1;
     }
-    
-    /* This is the main loop of the server. */
-    while (newsockfd != -1)
+    config.in_memory = engine == "memory";
+    std::string profile = args["rocksdb-profile"].as<std::string>();
+    auto db_options = rocksdb_profile(profile, args["block-cache-bytes"].as<size_t>());
+    if (!db_options)
     {
-        /* Receive the port of the responsible server as a proto message */
-        auto [bytecount, buffer] = secure_recv(newsockfd);
-        if (bytecount <= 0)
+        fmt::print(stderr, "Unknown RocksDB profile {}, expected one of {}\n", profile, rocksdb_profile_names);
+        return 1;
+    }
+    config.db_options = *db_options;
+    if (args.count("data-dir"))
+    {
+        config.data_dir = args["data-dir"].as<std::string>();
+        if (config.cores > 0)
         {
-            break;
+            std::filesystem::create_directories(config.data_dir);
         }
-        if (buffer == nullptr || bytecount == 0)
+    }
+    if (args.count("rocksdb-options"))
+    {
+        auto status = apply_options_file(args["rocksdb-options"].as<std::string>(), config.db_options);
+        if (!status.ok())
         {
+            fmt::print(stderr, "Invalid RocksDB options: {}\n", status.ToString());
             return 1;
         }
-        /* Parsing the message from the buffer */
-        server::server_msg request;
-        auto size = bytecount;
-        std::string server_message(buffer.get(), size);
-        request.ParseFromString(server_message);
-        /* Get the port from proto message */
-        server::server_msg response;
-        response.set_operation(request.operation());
-        response.set_key(request.key());
-        response.set_key_exists(true); // assume key exists, make it false if not found in get request
-        if (request.operation() == server::server_msg::GET)
-        {
-            std::string value;
-            rocksdb::Status status = db->Get(rocksdb::ReadOptions(), std::to_string(request.key()), &value);
-            if (status.ok())
-            {
-                response.set_value(value);
-                response.set_success(true);
-            }
-            else
-            {
-                response.set_key_exists(false);
-                response.set_success(false);
-            }
-        }
-        else if (request.operation() == server::server_msg::PUT)
-        {
-            rocksdb::Status status = db->Put(rocksdb::WriteOptions(), std::to_string(request.key()), request.value());
-            if (status.ok())
-            {
-                response.set_success(true);
-            }
-            else
-            {
-                response.set_success(false);
-            }
-        }
-        else if (request.operation() == server::server_msg::DELETE)
-        {
-            rocksdb::Status status = db->Delete(rocksdb::WriteOptions(), std::to_string(request.key()));
-            if (status.ok())
-            {
-                response.set_success(true);
-            }
-            else
-            {
-                response.set_success(false);
-            }
-        }
-        else
-        {
-            response.set_success(false);
-        }
-        /* Delete comes from the master and does not require a response */
-        if (request.operation() != server::server_msg::DELETE)
-        {
-            /* Sending the response to the client. */
-            std::string response_str;
-            response.SerializeToString(&response_str);
-            auto msg_size = response_str.size();
-            auto buf = std::make_unique<char[]>(msg_size + length_size_field);
-            construct_message(buf.get(), response_str.c_str(), msg_size);
-            secure_send(newsockfd, buf.get(), msg_size + length_size_field);
-        }
-        /* Accepting the connection from the client. */
-        newsockfd = accept_connection(sockfd);
+    }
+    if (config.use_uring && !UringThread::supported())
+    {
+        fmt::print(stderr, "io_uring is not supported by this kernel, falling back to epoll\n");
+        config.use_uring = false;
     }
 
-    /* Closing the sockets. */
-    close(newsockfd);
-    close(sockfd);
+    /* A peer that closes early, e.g. the receiver of an SST transfer, must not kill the server with all its connections */
+    signal(SIGPIPE, SIG_IGN);
+
+    if (config.cores > 0)
+    {
+        run_shard_per_core(config);
+    }
+    else
+    {
+        run_shared(config);
+    }
 
     return 0;
-}
\ No newline at end of file
+}
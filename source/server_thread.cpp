@@ -0,0 +1,443 @@
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <utility>
+
+#include "server_thread.h"
+
+#include <pthread.h>
+#include <sched.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "binary_protocol.h"
+#include "request_handler.h"
+#include "shared.h"
+
+namespace {
+
+/* Upper bound of events handled per epoll_wait call. */
+constexpr int max_events = 64;
+/* Size of the chunks read from a socket at once. */
+constexpr size_t read_chunk_size = 16 * 1024;
+
+/* epoll tokens of the two fds every IoThread watches besides connections. */
+constexpr uint64_t listen_token = 0;
+constexpr uint64_t wakeup_token = 1;
+
+} // namespace
+
+auto pin_to_core(std::thread &thread, size_t core) -> bool {
+  cpu_set_t cpus;
+  CPU_ZERO(&cpus);
+  CPU_SET(core, &cpus);
+  return pthread_setaffinity_np(thread.native_handle(), sizeof(cpus), &cpus) ==
+         0;
+}
+
+WorkerPool::WorkerPool(size_t nb_threads) {
+  threads.reserve(nb_threads);
+  for (auto i = 0ULL; i < nb_threads; ++i) {
+    threads.emplace_back([this] { run(); });
+  }
+}
+
+WorkerPool::~WorkerPool() {
+  {
+    std::lock_guard l(tasks_lock);
+    stopping = true;
+  }
+  tasks_cond.notify_all();
+  for (auto &thread : threads) {
+    thread.join();
+  }
+}
+
+auto WorkerPool::submit(Task &&task) -> void {
+  {
+    std::lock_guard l(tasks_lock);
+    tasks.push_back(std::move(task));
+  }
+  tasks_cond.notify_one();
+}
+
+auto WorkerPool::run() -> void {
+  while (true) {
+    Task task;
+    {
+      std::unique_lock l(tasks_lock);
+      tasks_cond.wait(l, [this] { return stopping || !tasks.empty(); });
+      if (tasks.empty()) {
+        return;
+      }
+      task = std::move(tasks.front());
+      tasks.pop_front();
+    }
+    task();
+  }
+}
+
+ServerLoop::ServerLoop(int listen_fd, Store store, WorkerPool *workers)
+    : listen_fd(listen_fd), store(store), workers(workers),
+      reply_to_thread([this](std::unique_ptr<Batch> &&batch) {
+        complete(std::move(batch));
+      }),
+      post_to_thread([this](Task &&task) { post(std::move(task)); }) {
+  wakeup_fd = eventfd(0, EFD_NONBLOCK);
+  if (wakeup_fd < 0) {
+    perror("Error creating the wakeup eventfd");
+    exit(1);
+  }
+}
+
+ServerLoop::~ServerLoop() { close(wakeup_fd); }
+
+/**
+ * It hands every complete request frame of the connection to the worker pool,
+ * or runs them on this thread when there is no pool. The frames of one
+ * dispatch go out as one batch, so responses keep the request order, unless
+ * all of them carry a request id: then they are spread over the workers by
+ * key and answered as they complete. Only the frames of one dispatch are in
+ * the pool at a time. With group commit, or for a BOOTSTRAP_SEND, the
+ * responses of the requests run on this thread come back through complete()
+ * as well. A batch that is not split reuses the buffers of the previous batch
+ * of the connection. The first byte of a connection tells its encoding:
+ * binary_magic, which is then dropped, or the first byte of a server_msg
+ * frame.
+ *
+ * @return false if the connection sent a malformed frame
+ */
+auto ServerLoop::dispatch(uint64_t conn_id, Connection &conn) -> bool {
+  if (conn.in_flight > 0) {
+    return true;
+  }
+  if (!conn.encoding) {
+    if (conn.in.empty()) {
+      return true;
+    }
+    conn.encoding = Encoding::protobuf;
+    if (static_cast<unsigned char>(conn.in[0]) == binary_magic) {
+      conn.encoding = Encoding::binary;
+      conn.in.erase(0, 1);
+    }
+  }
+  auto encoding = *conn.encoding;
+  auto consumed = encoding == Encoding::binary
+                      ? complete_binary_frames(conn.in, max_message_size)
+                      : complete_frames(conn.in);
+  if (!consumed) {
+    debug_print("[{}] malformed frame on connection {}\n", __func__, conn_id);
+    return false;
+  }
+  if (*consumed == 0) {
+    return true;
+  }
+  if (workers == nullptr && store.committer == nullptr) {
+    auto ran =
+        handle_requests(store, encoding, conn.in.data(), *consumed, conn.out);
+    conn.in.erase(0, ran);
+    /* The rest starts with a BOOTSTRAP_SEND, which leaves the thread */
+    *consumed -= ran;
+    if (*consumed == 0) {
+      return true;
+    }
+  }
+  std::vector<std::string> splits;
+  if (workers != nullptr) {
+    splits = split_pipelined(encoding, conn.in.data(), *consumed,
+                             workers->size());
+  }
+  conn.in_flight = std::max<size_t>(splits.size(), 1);
+  if (splits.empty()) {
+    auto batch = conn.spare ? std::move(conn.spare) : std::make_unique<Batch>();
+    batch->frames.assign(conn.in, 0, *consumed);
+    conn.in.erase(0, *consumed);
+    submit(conn_id, encoding, std::move(batch));
+    return true;
+  }
+  conn.in.erase(0, *consumed);
+  for (auto &split : splits) {
+    auto batch = std::make_unique<Batch>();
+    batch->frames = std::move(split);
+    submit(conn_id, encoding, std::move(batch));
+  }
+  return true;
+}
+
+/**
+ * It runs a batch in the worker pool, or without one on this thread. The task
+ * owns the batch through a raw pointer: two pointers fit into a Task without
+ * allocating.
+ */
+auto ServerLoop::submit(uint64_t conn_id, Encoding encoding,
+                        std::unique_ptr<Batch> &&batch) -> void {
+  batch->conn_id = conn_id;
+  batch->encoding = encoding;
+  auto run = [this, batch = batch.release()] {
+    handle_requests(store, std::unique_ptr<Batch>(batch), reply_to_thread,
+                    post_to_thread);
+  };
+  if (workers != nullptr) {
+    workers->submit(std::move(run));
+  } else {
+    run();
+  }
+}
+
+auto ServerLoop::complete(std::unique_ptr<Batch> &&batch) -> void {
+  {
+    std::lock_guard l(completions_lock);
+    completions.push_back(std::move(batch));
+  }
+  uint64_t one = 1;
+  [[maybe_unused]] auto ret = write(wakeup_fd, &one, sizeof(one));
+}
+
+auto ServerLoop::post(Task &&task) -> void {
+  if (workers != nullptr) {
+    workers->submit(std::move(task));
+    return;
+  }
+  {
+    std::lock_guard l(completions_lock);
+    posted.push_back(std::move(task));
+  }
+  uint64_t one = 1;
+  [[maybe_unused]] auto ret = write(wakeup_fd, &one, sizeof(one));
+}
+
+/* It runs the tasks posted to the thread; they may post or complete more. */
+auto ServerLoop::run_posted() -> void {
+  std::vector<Task> tasks;
+  {
+    std::lock_guard l(completions_lock);
+    tasks.swap(posted);
+  }
+  for (auto &task : tasks) {
+    task();
+  }
+}
+
+/**
+ * It queues the responses of a batch that came back for sending and keeps the
+ * batch for the next one of the connection.
+ */
+auto ServerLoop::finish(Connection &conn, std::unique_ptr<Batch> &&batch)
+    -> void {
+  --conn.in_flight;
+  if (conn.out.empty()) {
+    conn.out.swap(batch->responses);
+  } else {
+    conn.out.append(batch->responses);
+  }
+  conn.spare = std::move(batch);
+}
+
+auto ServerLoop::take_completions() -> std::vector<std::unique_ptr<Batch>> {
+  std::vector<std::unique_ptr<Batch>> done;
+  std::lock_guard l(completions_lock);
+  done.swap(completions);
+  return done;
+}
+
+IoThread::IoThread(int listen_fd, Store store, WorkerPool *workers)
+    : ServerLoop(listen_fd, store, workers) {
+  next_conn_id = wakeup_token + 1;
+  epoll_fd = epoll_create1(0);
+  if (epoll_fd < 0) {
+    perror("Error creating the event loop");
+    exit(1);
+  }
+  /* Several IoThreads share the listening socket, only one is woken up per
+   * incoming connection. */
+  watch(listen_fd, listen_token, EPOLLIN | EPOLLEXCLUSIVE, EPOLL_CTL_ADD);
+  watch(wakeup_fd, wakeup_token, EPOLLIN, EPOLL_CTL_ADD);
+}
+
+IoThread::~IoThread() {
+  for (auto &[id, conn] : connections) {
+    close(conn.fd);
+  }
+  close(epoll_fd);
+}
+
+auto IoThread::watch(int fd, uint64_t token, uint32_t events, int op) -> void {
+  epoll_event ev{};
+  ev.events = events;
+  ev.data.u64 = token;
+  if (epoll_ctl(epoll_fd, op, fd, &ev) < 0) {
+    perror("Error in epoll_ctl");
+  }
+}
+
+auto IoThread::run() -> void {
+  std::array<epoll_event, max_events> events{};
+  while (true) {
+    int ready = epoll_wait(epoll_fd, events.data(), events.size(), -1);
+    if (ready < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      perror("Error in epoll_wait");
+      return;
+    }
+    for (int i = 0; i < ready; ++i) {
+      auto token = events[i].data.u64;
+      if (token == listen_token) {
+        accept_connections();
+        continue;
+      }
+      if (token == wakeup_token) {
+        drain_completions();
+        continue;
+      }
+      auto it = connections.find(token);
+      if (it == connections.end()) {
+        continue;
+      }
+      auto &conn = it->second;
+      bool alive = true;
+      if (!conn.peer_closed &&
+          (events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP))) {
+        alive = receive(conn);
+      }
+      settle(token, conn, alive);
+    }
+  }
+}
+
+auto IoThread::accept_connections() -> void {
+  int fd;
+  while ((fd = accept_connection(listen_fd)) >= 0) {
+    if (set_nonblocking(fd) < 0) {
+      close(fd);
+      continue;
+    }
+    auto id = next_conn_id++;
+    auto &conn = connections[id];
+    conn.fd = fd;
+    conn.watched = EPOLLIN;
+    watch(fd, id, conn.watched, EPOLL_CTL_ADD);
+  }
+}
+
+/**
+ * It drains the socket into the receive buffer of the connection, up to
+ * max_buffered_input bytes: a client that sends faster than its requests
+ * run is left to wait in the socket.
+ *
+ * @return false if the connection is broken
+ */
+auto IoThread::receive(EpollConnection &conn) -> bool {
+  while (conn.in.size() < max_buffered_input) {
+    auto offset = conn.in.size();
+    conn.in.resize(offset + read_chunk_size);
+    auto bytes = recv(conn.fd, conn.in.data() + offset, read_chunk_size, 0);
+    conn.in.resize(offset + (bytes > 0 ? bytes : 0));
+    if (bytes > 0) {
+      continue;
+    }
+    if (bytes == 0) {
+      conn.peer_closed = true;
+      return true;
+    }
+    if (errno == EINTR) {
+      continue;
+    }
+    return errno == EAGAIN || errno == EWOULDBLOCK;
+  }
+  return true;
+}
+
+/**
+ * It sends as much of the pending responses as the socket accepts.
+ *
+ * @return false if the connection is broken
+ */
+auto IoThread::flush(EpollConnection &conn) -> bool {
+  size_t sent = 0;
+  while (sent < conn.out.size()) {
+    auto bytes = send(conn.fd, conn.out.data() + sent, conn.out.size() - sent,
+                      MSG_NOSIGNAL);
+    if (bytes < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        break;
+      }
+      return false;
+    }
+    sent += bytes;
+  }
+  conn.out.erase(0, sent);
+  return true;
+}
+
+/**
+ * @return the events to watch the connection for: readability unless the
+ * peer closed it, which only needs the remaining responses flushed, or its
+ * receive buffer is full, and writability while responses are left
+ */
+auto IoThread::wanted_events(EpollConnection const &conn) -> uint32_t {
+  uint32_t events = conn.peer_closed ? 0U : static_cast<uint32_t>(EPOLLIN);
+  if (conn.in.size() >= max_buffered_input) {
+    events = 0U;
+  }
+  if (!conn.out.empty()) {
+    events |= static_cast<uint32_t>(EPOLLOUT);
+  }
+  return events;
+}
+
+auto IoThread::drain_completions() -> void {
+  uint64_t count;
+  [[maybe_unused]] auto ret = read(wakeup_fd, &count, sizeof(count));
+  run_posted();
+  for (auto &batch : take_completions()) {
+    auto conn_id = batch->conn_id;
+    auto it = connections.find(conn_id);
+    if (it == connections.end()) {
+      continue;
+    }
+    auto &conn = it->second;
+    finish(conn, std::move(batch));
+    settle(conn_id, conn, true);
+  }
+}
+
+/**
+ * It moves the connection forward after an event: dispatches the buffered
+ * requests, flushes the responses, updates the events it is watched for and
+ * closes the connection once it is broken, or once the peer is gone and
+ * nothing is left to do for it.
+ */
+auto IoThread::settle(uint64_t conn_id, EpollConnection &conn,
+                      bool alive) -> void {
+  alive = alive && dispatch(conn_id, conn) && flush(conn);
+  if (alive) {
+    /* Not watching a closed peer for input also stops the level-triggered
+     * EOF from waking the loop up again. */
+    auto events = wanted_events(conn);
+    if (events != conn.watched) {
+      watch(conn.fd, conn_id, events, EPOLL_CTL_MOD);
+      conn.watched = events;
+    }
+  }
+  bool idle = conn.in_flight == 0 && conn.out.empty();
+  if (!alive || (conn.peer_closed && idle)) {
+    close_connection(conn_id);
+  }
+}
+
+auto IoThread::close_connection(uint64_t conn_id) -> void {
+  auto it = connections.find(conn_id);
+  if (it == connections.end()) {
+    return;
+  }
+  epoll_ctl(epoll_fd, EPOLL_CTL_DEL, it->second.fd, nullptr);
+  close(it->second.fd);
+  connections.erase(it);
+}
@@ -0,0 +1,172 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "request_handler.h"
+#include "shared.h"
+
+/**
+ ** Threading model of the server.
+ **
+ ** I/O threads (ServerLoops) own the sockets: each one runs an event loop
+ ** over the shared listening socket and the connections it accepted, reads
+ ** framed requests and writes the framed responses back on the same
+ ** connection. IoThread is the epoll transport, UringThread (uring_thread.h)
+ ** the io_uring one.
+ ** The WorkerPool runs the requests (protobuf parsing and the calls on the
+ ** shared rocksdb::DB) and hands the responses back to the owning thread.
+ ** Without a WorkerPool the I/O thread runs the requests itself; this is how
+ ** the shard-per-core mode runs one reactor per core, each with its own
+ ** listening socket and its own rocksdb::DB.
+ ** With a GroupCommitter the responses of writes come back from the commit
+ ** thread, through the same queue as the ones of the WorkerPool; the requests
+ ** after them go on in the WorkerPool, or without one on the I/O thread.
+ **/
+
+/**
+ ** It pins the thread to the given core.
+ **
+ ** @return false if the affinity could not be set
+ **/
+auto pin_to_core(std::thread &thread, size_t core) -> bool;
+
+class WorkerPool {
+public:
+  using Task = std::function<void()>;
+
+  explicit WorkerPool(size_t nb_threads);
+  ~WorkerPool();
+
+  WorkerPool(WorkerPool const &) = delete;
+  WorkerPool(WorkerPool &&) = delete;
+  auto operator=(WorkerPool const &) -> WorkerPool & = delete;
+  auto operator=(WorkerPool &&) -> WorkerPool & = delete;
+
+  auto submit(Task &&task) -> void;
+
+  [[nodiscard]] auto size() const -> size_t { return threads.size(); }
+
+private:
+  auto run() -> void;
+
+  std::mutex tasks_lock;
+  std::condition_variable tasks_cond;
+  std::deque<Task> tasks;
+  bool stopping{false};
+  std::vector<std::thread> threads;
+};
+
+/**
+ ** The part of an I/O thread that does not depend on the transport: the
+ ** request buffers of the connections, the hand-off of complete requests to
+ ** the WorkerPool and the queue through which the pool hands responses back.
+ **/
+class ServerLoop {
+public:
+  ServerLoop(int listen_fd, Store store, WorkerPool *workers);
+  virtual ~ServerLoop();
+
+  ServerLoop(ServerLoop const &) = delete;
+  ServerLoop(ServerLoop &&) = delete;
+  auto operator=(ServerLoop const &) -> ServerLoop & = delete;
+  auto operator=(ServerLoop &&) -> ServerLoop & = delete;
+
+  /**
+   ** It runs the event loop of the thread; it only returns on a fatal error.
+   **/
+  virtual auto run() -> void = 0;
+
+  /**
+   ** It hands a finished request batch, with its framed responses, back to
+   ** the thread. It may be called from any thread.
+   **/
+  auto complete(std::unique_ptr<Batch> &&batch) -> void;
+
+  /**
+   ** It runs task in the WorkerPool, or without one on the thread. It may be
+   ** called from any thread.
+   **/
+  auto post(Task &&task) -> void;
+
+protected:
+  struct Connection {
+    int fd{-1};
+    std::string in;  // received bytes that are not dispatched yet
+    std::string out; // framed responses that are not sent yet
+    size_t in_flight{0};     // batches of this connection in the pool
+    bool peer_closed{false}; // the peer will not send any more requests
+    std::optional<Encoding> encoding; // known from the first byte
+    std::unique_ptr<Batch> spare; // the buffers of its last batch, for the next
+  };
+
+  /* Bytes of unprocessed requests buffered per connection before it is no
+   * longer read, which leaves room for one frame of the largest size and
+   * one more read of 16 KiB. */
+  static constexpr size_t max_buffered_input = max_message_size + 16 * 1024;
+
+  auto dispatch(uint64_t conn_id, Connection &conn) -> bool;
+  auto take_completions() -> std::vector<std::unique_ptr<Batch>>;
+  auto run_posted() -> void;
+  static auto finish(Connection &conn, std::unique_ptr<Batch> &&batch) -> void;
+
+  int listen_fd;
+  /* eventfd signalled by complete() and post() */
+  int wakeup_fd{-1};
+  Store store;
+  WorkerPool *workers;
+  uint64_t next_conn_id{0};
+
+private:
+  auto submit(uint64_t conn_id, Encoding encoding,
+              std::unique_ptr<Batch> &&batch) -> void;
+
+  Reply reply_to_thread;
+  Schedule post_to_thread;
+  std::mutex completions_lock;
+  std::vector<std::unique_ptr<Batch>> completions;
+  std::vector<Task> posted;
+};
+
+/**
+ ** The epoll transport.
+ **/
+class IoThread : public ServerLoop {
+public:
+  IoThread(int listen_fd, Store store, WorkerPool *workers);
+  ~IoThread() override;
+
+  IoThread(IoThread const &) = delete;
+  IoThread(IoThread &&) = delete;
+  auto operator=(IoThread const &) -> IoThread & = delete;
+  auto operator=(IoThread &&) -> IoThread & = delete;
+
+  auto run() -> void override;
+
+private:
+  struct EpollConnection : Connection {
+    uint32_t watched{0}; // the events epoll reports for it
+  };
+
+  auto accept_connections() -> void;
+  auto receive(EpollConnection &conn) -> bool;
+  auto flush(EpollConnection &conn) -> bool;
+  auto drain_completions() -> void;
+  auto watch(int fd, uint64_t token, uint32_t events, int op) -> void;
+  auto close_connection(uint64_t conn_id) -> void;
+  auto settle(uint64_t conn_id, EpollConnection &conn, bool alive) -> void;
+  static auto wanted_events(EpollConnection const &conn) -> uint32_t;
+
+  int epoll_fd{-1};
+  std::unordered_map<uint64_t, EpollConnection> connections;
+};
@@ -0,0 +1,79 @@
+#include <algorithm>
+#include <iterator>
+#include <mutex>
+#include <utility>
+
+#include "shard_map.h"
+
+auto ShardMapState::publish(uint64_t version,
+                            std::vector<int32_t> range_starts) -> void {
+  {
+    std::unique_lock guard(lock);
+    if (range_starts != starts) {
+      starts = std::move(range_starts);
+      requests = std::make_unique<std::atomic<uint64_t>[]>(starts.size());
+      counting.store(!starts.empty(), std::memory_order_release);
+    }
+    leaving_ranges.clear();
+    moving.store(false, std::memory_order_release);
+  }
+  published.store(version, std::memory_order_release);
+}
+
+auto ShardMapState::admits(uint64_t version) const -> bool {
+  auto current = this->version();
+  return version == 0 || current == 0 || version == current;
+}
+
+auto ShardMapState::admits_low(uint32_t version) const -> bool {
+  auto current = this->version();
+  return version == 0 || current == 0 ||
+         version == static_cast<uint32_t>(current);
+}
+
+auto ShardMapState::leave(int32_t start, int32_t end,
+                          std::unique_ptr<PlacementStrategy> slice, int port)
+    -> void {
+  std::unique_lock guard(lock);
+  /* A migration that tries a page again leaves the same keys again */
+  leaving_ranges.insert_or_assign(start, Leaving{end, std::move(slice), port});
+  moving.store(true, std::memory_order_release);
+}
+
+auto ShardMapState::leaving(int32_t key) const -> bool {
+  if (!moving.load(std::memory_order_acquire)) {
+    return false;
+  }
+  std::shared_lock guard(lock);
+  auto it = leaving_ranges.upper_bound(key);
+  if (it == leaving_ranges.begin()) {
+    return false;
+  }
+  auto const &range = std::prev(it)->second;
+  return key <= range.end &&
+         (range.slice == nullptr || range.slice->owner(key) != range.port);
+}
+
+auto ShardMapState::count(int32_t key) -> void {
+  if (!counting.load(std::memory_order_acquire)) {
+    return;
+  }
+  std::shared_lock guard(lock);
+  auto it = std::upper_bound(starts.begin(), starts.end(), key);
+  if (it != starts.begin()) {
+    requests[static_cast<size_t>(it - starts.begin()) - 1].fetch_add(
+        1, std::memory_order_relaxed);
+  }
+}
+
+auto ShardMapState::take_requests(int32_t start, int32_t end) -> uint64_t {
+  std::shared_lock guard(lock);
+  uint64_t total = 0;
+  auto first = std::lower_bound(starts.begin(), starts.end(), start);
+  auto last = std::upper_bound(starts.begin(), starts.end(), end);
+  for (auto it = first; it < last; ++it) {
+    total += requests[static_cast<size_t>(it - starts.begin())].exchange(
+        0, std::memory_order_relaxed);
+  }
+  return total;
+}
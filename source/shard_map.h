@@ -0,0 +1,88 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <shared_mutex>
+#include <vector>
+
+#include "placement.h"
+
+/**
+ ** What a server knows of the shard map of the master: the version the
+ ** master published last and, in range placement, the first keys of the
+ ** ranges.
+ **
+ ** A client that routes requests by a cached copy of the map stamps them
+ ** with its version. Once the master published another version, which it
+ ** does before any key moves, the server rejects those requests and the
+ ** client fetches the map again. Requests without a version, of clients
+ ** that talk to the server directly or of the master, always run. The
+ ** server counts the stamped requests of every range, which the master
+ ** reads with KEY_COUNT as the load of the range, since it no longer sees
+ ** the lookups.
+ **
+ ** While a migration moves keys away from the server, the writes to them
+ ** are rejected too, whatever version they carry: a client that located a
+ ** key just before its move started would otherwise write it after the
+ ** move read it.
+ **/
+class ShardMapState {
+public:
+  /**
+   ** It installs a version published by the master. The counts start over
+   ** if the ranges changed, and no key is leaving any more.
+   **/
+  auto publish(uint64_t version, std::vector<int32_t> range_starts) -> void;
+
+  /* @return the version published last, 0 before the first one */
+  [[nodiscard]] auto version() const -> uint64_t {
+    return published.load(std::memory_order_acquire);
+  }
+
+  /**
+   ** @return true if a request stamped with version, 0 for none, may run; a
+   ** server the master has not told a version yet runs all of them
+   **/
+  [[nodiscard]] auto admits(uint64_t version) const -> bool;
+
+  /* admits() for the low 32 bits of the version that binary requests carry */
+  [[nodiscard]] auto admits_low(uint32_t version) const -> bool;
+
+  /**
+   ** It marks the keys from start to end that a migration moves away until
+   ** the next publish(): all of them, or with a slice only the ones that
+   ** it gives to another server than the one at port.
+   **/
+  auto leave(int32_t start, int32_t end,
+             std::unique_ptr<PlacementStrategy> slice, int port) -> void;
+
+  /* @return true if writes to key have to be rejected as it moves away */
+  [[nodiscard]] auto leaving(int32_t key) const -> bool;
+
+  /* It counts a request on key of a client that routed it by the map. */
+  auto count(int32_t key) -> void;
+
+  /**
+   ** @return the requests counted on the ranges that start from start to
+   ** end since the last call, which resets them
+   **/
+  auto take_requests(int32_t start, int32_t end) -> uint64_t;
+
+private:
+  /* Keys that leave, up to end, the first key of which they are mapped by */
+  struct Leaving {
+    int32_t end;
+    std::unique_ptr<PlacementStrategy> slice;
+    int port;
+  };
+
+  std::atomic<uint64_t> published{0};
+  std::atomic<bool> counting{false}; // whether there are ranges
+  std::atomic<bool> moving{false};   // whether keys are leaving
+  mutable std::shared_mutex lock;    // of the ranges and the leaving keys
+  std::vector<int32_t> starts;
+  std::map<int32_t, Leaving> leaving_ranges; // disjoint
+  std::unique_ptr<std::atomic<uint64_t>[]> requests; // of the ranges
+};
@@ -5,8 +5,10 @@
 
 #include "shared.h"
 
+#include <fcntl.h>
 #include <netdb.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <sys/socket.h>
 #include <sys/types.h>
 
@@ -22,7 +24,27 @@ int accept_connection(int sockfd)
     return newsockfd;
 }
 
-int listening_socket(int port)
+/**
+ * It switches the socket into non-blocking mode and disables Nagle's
+ * algorithm, which is what the event loop expects from every connection.
+ *
+ * @param fd the file descriptor of the socket
+ *
+ * @return 0 on success, -1 on failure
+ */
+int set_nonblocking(int fd)
+{
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0)
+    {
+        return -1;
+    }
+    int enable = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(enable));
+    return 0;
+}
+
+int listening_socket(int port, bool reuse_port)
 {
     /* Creating a socket. */
     int sockfd = socket(AF_INET, SOCK_STREAM, 0);
@@ -46,6 +68,8 @@ int listening_socket(int port)
     int enable = 1;
     if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(int)) < 0)
         perror("setsockopt(SO_REUSEADDR) failed");
+    if (reuse_port && setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &enable, sizeof(int)) < 0)
+        perror("setsockopt(SO_REUSEPORT) failed");
     if (bind(sockfd, (struct sockaddr *)&serv_addr, sizeof(serv_addr)) < 0)
     {
         perror("Binding failed\n");
@@ -53,7 +77,7 @@ int listening_socket(int port)
     }
 
     /* Listening for incoming connections. */
-    if (listen(sockfd, 1) < 0)
+    if (listen(sockfd, SOMAXCONN) < 0)
     {
         return -1;
     }
@@ -167,6 +191,19 @@ auto secure_recv(int fd) -> std::pair<size_t, std::unique_ptr<char[]>> {
   return {actual_msg_size, std::move(buf)};
 }
 
+/**
+ * It reads exactly n bytes, like secure_recv() reads a message.
+ *
+ * @param fd The file descriptor to read from
+ * @param buffer The buffer of at least n bytes to read into
+ * @param n The number of bytes to read
+ *
+ * @return false if the peer closed before n bytes arrived
+ */
+auto secure_recv_exact(int fd, char *buffer, size_t n) -> bool {
+  return read_n(fd, buffer, n) == n;
+}
+
 /**
  * It sends all the data
  * through the socket
@@ -5,6 +5,8 @@
 #include <cstring>
 #include <memory>
 #include <optional>
+#include <string>
+#include <string_view>
 
 #include <netdb.h>
 #include <netinet/in.h>
@@ -35,6 +37,7 @@ template <class... Args> void debug_print(Args &&...) {}
 #endif
 
 static constexpr auto length_size_field = sizeof(uint32_t);
+static constexpr uint32_t max_message_size = 64 * 1024 * 1024;
 static constexpr auto client_base_addr = 30500;
 static constexpr auto number_of_connect_attempts = 20;
 static constexpr auto gets_per_mille = 200;
@@ -48,7 +51,7 @@ template <class... Ts> overloaded(Ts...) -> overloaded<Ts...>;
  ** It takes as an argument a ptr to an array of size 4 or bigger and
  ** converts the char array into an integer.
  **/
-inline auto convert_byte_array_to_int(char *b) noexcept -> uint32_t {
+inline auto convert_byte_array_to_int(const char *b) noexcept -> uint32_t {
   if constexpr (LITTLE_ENDIAN) {
 #if defined(__GNUC__)
     uint32_t res = 0;
@@ -107,6 +110,9 @@ public:
 [[nodiscard]] auto secure_recv(int fd)
     -> std::pair<size_t, std::unique_ptr<char[]>>;
 
+/* It reads exactly n bytes, of a frame without a length field. */
+[[nodiscard]] auto secure_recv_exact(int fd, char *buffer, size_t n) -> bool;
+
 // NOLINTNEXTLINE(cppcoreguidelines-avoid-non-const-global-variables)
 extern hostent *hostip;
 
@@ -129,6 +135,53 @@ inline void construct_message(char *dst, const char *payload,
   ::memcpy(dst + length_size_field, payload, payload_size);
 }
 
+/**
+ * It appends one framed message (length field followed by the payload) to
+ * the end of dst. Used by the event loop, which batches all responses of a
+ * connection into a single send buffer.
+ */
+inline void append_message(std::string &dst, std::string_view payload) {
+  auto offset = dst.size();
+  dst.resize(offset + length_size_field + payload.size());
+  construct_message(dst.data() + offset, payload.data(), payload.size());
+}
+
+/**
+ * It appends one framed protobuf message to the end of dst like
+ * append_message(), serialized in place instead of through a temporary
+ * string.
+ */
+template <typename Message>
+inline void append_serialized(std::string &dst, const Message &msg) {
+  auto size = msg.ByteSizeLong();
+  auto offset = dst.size();
+  dst.resize(offset + length_size_field + size);
+  convert_int_to_byte_array(dst.data() + offset, static_cast<uint32_t>(size));
+  msg.SerializeWithCachedSizesToArray(
+      reinterpret_cast<uint8_t *>(dst.data() + offset + length_size_field));
+}
+
+/**
+ * It returns how many leading bytes of buf form complete messages, i.e. the
+ * prefix that can be handed over for processing, or std::nullopt if a
+ * message announces a size above max_message_size.
+ */
+inline auto complete_frames(std::string_view buf) -> std::optional<size_t> {
+  size_t offset = 0;
+  while (buf.size() - offset >= length_size_field) {
+    auto size = convert_byte_array_to_int(buf.data() + offset);
+    if (size > max_message_size) {
+      return std::nullopt;
+    }
+    if (buf.size() - offset - length_size_field < size) {
+      break;
+    }
+    offset += length_size_field + size;
+  }
+  return offset;
+}
+
 int connect_socket(const char *hostname, const int port);
-int listening_socket(int port);
+int listening_socket(int port, bool reuse_port = false);
 int accept_connection(int listening_socket);
+int set_nonblocking(int fd);
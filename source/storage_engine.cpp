@@ -0,0 +1,58 @@
+#include <memory>
+
+#include "storage_engine.h"
+
+#include "rocksdb/iterator.h"
+
+auto RocksDbEngine::get(rocksdb::Slice key, rocksdb::PinnableSlice *value)
+    -> rocksdb::Status {
+  return db->Get(rocksdb::ReadOptions(), db->DefaultColumnFamily(), key, value);
+}
+
+auto RocksDbEngine::multi_get(std::vector<rocksdb::Slice> const &keys,
+                              std::vector<std::string> *values)
+    -> std::vector<rocksdb::Status> {
+  return db->MultiGet(rocksdb::ReadOptions(), keys, values);
+}
+
+auto RocksDbEngine::put(rocksdb::Slice key, rocksdb::Slice value)
+    -> rocksdb::Status {
+  return db->Put(rocksdb::WriteOptions(), key, value);
+}
+
+auto RocksDbEngine::remove(rocksdb::Slice key) -> rocksdb::Status {
+  return db->Delete(rocksdb::WriteOptions(), key);
+}
+
+auto RocksDbEngine::merge(rocksdb::Slice key, rocksdb::Slice operand)
+    -> rocksdb::Status {
+  return db->Merge(rocksdb::WriteOptions(), key, operand);
+}
+
+auto RocksDbEngine::write(rocksdb::WriteBatch *batch, bool sync)
+    -> rocksdb::Status {
+  rocksdb::WriteOptions options;
+  options.sync = sync;
+  return db->Write(options, batch);
+}
+
+auto RocksDbEngine::scan(rocksdb::Slice start, rocksdb::Slice end,
+                         ScanVisit const &visit) -> rocksdb::Status {
+  rocksdb::ReadOptions options;
+  options.total_order_seek = true;
+  std::unique_ptr<rocksdb::Iterator> it(db->NewIterator(options));
+  for (it->Seek(start); it->Valid() && it->key().compare(end) <= 0;
+       it->Next()) {
+    if (!visit(it->key(), it->value())) {
+      break;
+    }
+  }
+  return it->status();
+}
+
+auto RocksDbEngine::ingest(std::string const &path) -> rocksdb::Status {
+  rocksdb::IngestExternalFileOptions options;
+  /* A hard link if the file is on the file system of the database */
+  options.move_files = true;
+  return db->IngestExternalFile({path}, options);
+}
@@ -0,0 +1,113 @@
+#pragma once
+
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "rocksdb/db.h"
+#include "rocksdb/slice.h"
+#include "rocksdb/status.h"
+#include "rocksdb/write_batch.h"
+
+/**
+ ** The local KV store of a shard as the request handlers see it.
+ **
+ ** Keys are the encoded keys of key_encoding.h. The engines keep the
+ ** vocabulary of RocksDB: a missing key is Status::NotFound() and a group of
+ ** updates is a rocksdb::WriteBatch that the engine applies atomically. All
+ ** methods may be called from any number of threads at once.
+ **/
+class StorageEngine {
+public:
+  StorageEngine() = default;
+  virtual ~StorageEngine() = default;
+
+  StorageEngine(StorageEngine const &) = delete;
+  StorageEngine(StorageEngine &&) = delete;
+  auto operator=(StorageEngine const &) -> StorageEngine & = delete;
+  auto operator=(StorageEngine &&) -> StorageEngine & = delete;
+
+  /**
+   ** It looks key up. The value is pinned where the engine holds it, like
+   ** the block cache of RocksDB, or else copied into the buffer of value;
+   ** either way it stays valid until value is reset or destroyed.
+   **/
+  virtual auto get(rocksdb::Slice key, rocksdb::PinnableSlice *value)
+      -> rocksdb::Status = 0;
+
+  /**
+   ** It looks keys up; values is resized to the number of keys.
+   **
+   ** @return the status of each key
+   **/
+  virtual auto multi_get(std::vector<rocksdb::Slice> const &keys,
+                         std::vector<std::string> *values)
+      -> std::vector<rocksdb::Status> = 0;
+
+  virtual auto put(rocksdb::Slice key, rocksdb::Slice value)
+      -> rocksdb::Status = 0;
+
+  virtual auto remove(rocksdb::Slice key) -> rocksdb::Status = 0;
+
+  /**
+   ** It applies a counter operand (see counter_merge.h) to the value of key
+   ** without reading it first.
+   **/
+  virtual auto merge(rocksdb::Slice key, rocksdb::Slice operand)
+      -> rocksdb::Status = 0;
+
+  /**
+   ** It applies all updates of batch atomically. With sync the updates are
+   ** durable once it returns, if the engine is durable at all.
+   **/
+  virtual auto write(rocksdb::WriteBatch *batch, bool sync)
+      -> rocksdb::Status = 0;
+
+  using ScanVisit =
+      std::function<bool(rocksdb::Slice key, rocksdb::Slice value)>;
+
+  /**
+   ** It calls visit with the pairs of the keys from start to end, both
+   ** included, in key order until visit returns false.
+   **/
+  virtual auto scan(rocksdb::Slice start, rocksdb::Slice end,
+                    ScanVisit const &visit) -> rocksdb::Status = 0;
+
+  /**
+   ** It loads the pairs of an SST file written by rocksdb::SstFileWriter,
+   ** which overwrite the values of their keys. The file at path may be
+   ** moved or removed.
+   **
+   ** @return Status::NotSupported() if the engine cannot read SST files
+   **/
+  virtual auto ingest(std::string const &path) -> rocksdb::Status = 0;
+};
+
+/**
+ ** The durable engine: a RocksDB instance, which it owns. Its options need
+ ** the CounterMergeOperator.
+ **/
+class RocksDbEngine : public StorageEngine {
+public:
+  explicit RocksDbEngine(rocksdb::DB *db) : db(db) {}
+
+  auto get(rocksdb::Slice key, rocksdb::PinnableSlice *value)
+      -> rocksdb::Status override;
+  auto multi_get(std::vector<rocksdb::Slice> const &keys,
+                 std::vector<std::string> *values)
+      -> std::vector<rocksdb::Status> override;
+  auto put(rocksdb::Slice key, rocksdb::Slice value)
+      -> rocksdb::Status override;
+  auto remove(rocksdb::Slice key) -> rocksdb::Status override;
+  auto merge(rocksdb::Slice key, rocksdb::Slice operand)
+      -> rocksdb::Status override;
+  auto write(rocksdb::WriteBatch *batch, bool sync)
+      -> rocksdb::Status override;
+  auto scan(rocksdb::Slice start, rocksdb::Slice end, ScanVisit const &visit)
+      -> rocksdb::Status override;
+  auto ingest(std::string const &path) -> rocksdb::Status override;
+
+private:
+  std::unique_ptr<rocksdb::DB> db;
+};
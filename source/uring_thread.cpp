@@ -0,0 +1,515 @@
+#include <atomic>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <utility>
+
+#include "uring_thread.h"
+
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/utsname.h>
+#include <unistd.h>
+
+#include "shared.h"
+
+namespace {
+
+/* Entries of the submission queue; the completion queue is twice as big. */
+constexpr unsigned ring_entries = 1024;
+/* Provided receive buffers: count (a power of two) and size of each. */
+constexpr unsigned recv_buffer_count = 512;
+constexpr unsigned recv_buffer_size = 16 * 1024;
+constexpr uint16_t recv_buffer_group = 0;
+
+/* The upper byte of user_data tells what completed, the rest is the
+ * connection id. */
+enum class Op : uint64_t {
+  accept = 1,
+  recv = 2,
+  send = 3,
+  wakeup = 4,
+  provide = 5,
+  cancel = 6
+};
+constexpr int op_shift = 56;
+constexpr uint64_t id_mask = (1ULL << op_shift) - 1;
+
+constexpr auto user_data(Op op, uint64_t conn_id = 0) -> uint64_t {
+  return (static_cast<uint64_t>(op) << op_shift) | conn_id;
+}
+
+auto io_uring_setup(unsigned entries, io_uring_params *params) -> int {
+  return static_cast<int>(syscall(__NR_io_uring_setup, entries, params));
+}
+
+auto io_uring_enter(int fd, unsigned to_submit, unsigned min_complete,
+                    unsigned flags) -> int {
+  return static_cast<int>(syscall(__NR_io_uring_enter, fd, to_submit,
+                                  min_complete, flags, nullptr, 0));
+}
+
+template <class T> auto load_acquire(T *p) -> T {
+  return __atomic_load_n(p, __ATOMIC_ACQUIRE);
+}
+
+template <class T> auto store_release(T *p, T v) -> void {
+  __atomic_store_n(p, v, __ATOMIC_RELEASE);
+}
+
+} // namespace
+
+/**
+ ** A minimal io_uring: the mmapped submission and completion queues plus the
+ ** provided buffers the multishot receives pick from.
+ **/
+struct UringThread::Ring {
+  int fd{-1};
+
+  void *sq_ptr{nullptr};
+  size_t sq_size{0};
+  void *cq_ptr{nullptr};
+  size_t cq_size{0};
+  io_uring_sqe *sqes{nullptr};
+  size_t sqes_size{0};
+
+  unsigned *sq_head{nullptr};
+  unsigned *sq_tail{nullptr};
+  unsigned sq_mask{0};
+  unsigned sq_entries{0};
+  unsigned sq_local_tail{0};
+  unsigned sq_pending{0};
+
+  unsigned *cq_head{nullptr};
+  unsigned *cq_tail{nullptr};
+  unsigned cq_mask{0};
+  io_uring_cqe *cqes{nullptr};
+
+  char *buffers{nullptr};
+  size_t buffers_size{0};
+
+  Ring() = default;
+  Ring(Ring const &) = delete;
+  Ring(Ring &&) = delete;
+  auto operator=(Ring const &) -> Ring & = delete;
+  auto operator=(Ring &&) -> Ring & = delete;
+
+  ~Ring() {
+    if (buffers != nullptr) {
+      munmap(buffers, buffers_size);
+    }
+    if (sqes != nullptr) {
+      munmap(sqes, sqes_size);
+    }
+    if (cq_ptr != nullptr && cq_ptr != sq_ptr) {
+      munmap(cq_ptr, cq_size);
+    }
+    if (sq_ptr != nullptr) {
+      munmap(sq_ptr, sq_size);
+    }
+    if (fd >= 0) {
+      close(fd);
+    }
+  }
+
+  auto init() -> bool {
+    io_uring_params params{};
+    fd = io_uring_setup(ring_entries, &params);
+    if (fd < 0 || !(params.features & IORING_FEAT_CQE_SKIP)) {
+      return false;
+    }
+    sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cq_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+      sq_size = cq_size = std::max(sq_size, cq_size);
+    }
+    sq_ptr = mmap(nullptr, sq_size, PROT_READ | PROT_WRITE,
+                  MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    if (sq_ptr == MAP_FAILED) {
+      sq_ptr = nullptr;
+      return false;
+    }
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+      cq_ptr = sq_ptr;
+    } else {
+      cq_ptr = mmap(nullptr, cq_size, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+      if (cq_ptr == MAP_FAILED) {
+        cq_ptr = nullptr;
+        return false;
+      }
+    }
+    sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+    auto *sqes_ptr = mmap(nullptr, sqes_size, PROT_READ | PROT_WRITE,
+                          MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (sqes_ptr == MAP_FAILED) {
+      return false;
+    }
+    sqes = static_cast<io_uring_sqe *>(sqes_ptr);
+
+    auto *sq = static_cast<char *>(sq_ptr);
+    sq_head = reinterpret_cast<unsigned *>(sq + params.sq_off.head);
+    sq_tail = reinterpret_cast<unsigned *>(sq + params.sq_off.tail);
+    sq_mask = *reinterpret_cast<unsigned *>(sq + params.sq_off.ring_mask);
+    sq_entries = params.sq_entries;
+    sq_local_tail = *sq_tail;
+    /* The submission array maps slot i to sqe i once and for all. */
+    auto *array = reinterpret_cast<unsigned *>(sq + params.sq_off.array);
+    for (unsigned i = 0; i < sq_entries; ++i) {
+      array[i] = i;
+    }
+
+    auto *cq = static_cast<char *>(cq_ptr);
+    cq_head = reinterpret_cast<unsigned *>(cq + params.cq_off.head);
+    cq_tail = reinterpret_cast<unsigned *>(cq + params.cq_off.tail);
+    cq_mask = *reinterpret_cast<unsigned *>(cq + params.cq_off.ring_mask);
+    cqes = reinterpret_cast<io_uring_cqe *>(cq + params.cq_off.cqes);
+
+    return init_buffers();
+  }
+
+  /* It allocates the receive buffers and provides all of them. */
+  auto init_buffers() -> bool {
+    buffers_size = static_cast<size_t>(recv_buffer_count) * recv_buffer_size;
+    auto *buffers_ptr = mmap(nullptr, buffers_size, PROT_READ | PROT_WRITE,
+                             MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (buffers_ptr == MAP_FAILED) {
+      return false;
+    }
+    buffers = static_cast<char *>(buffers_ptr);
+    provide_buffers(0, recv_buffer_count);
+    return submit(0) >= 0;
+  }
+
+  [[nodiscard]] auto buffer(uint16_t bid) const -> char * {
+    return buffers + static_cast<size_t>(bid) * recv_buffer_size;
+  }
+
+  /* It hands a consumed receive buffer back to the kernel. */
+  auto recycle_buffer(uint16_t bid) -> void { provide_buffers(bid, 1); }
+
+  /* It queues the provision of count consecutive buffers from bid on; only
+   * a failed provision produces a completion. */
+  auto provide_buffers(uint16_t bid, unsigned count) -> void {
+    auto *sqe = get_sqe();
+    sqe->opcode = IORING_OP_PROVIDE_BUFFERS;
+    sqe->fd = static_cast<int32_t>(count);
+    sqe->addr = reinterpret_cast<uint64_t>(buffer(bid));
+    sqe->len = recv_buffer_size;
+    sqe->off = bid;
+    sqe->buf_group = recv_buffer_group;
+    sqe->flags = IOSQE_CQE_SKIP_SUCCESS;
+    sqe->user_data = user_data(Op::provide);
+  }
+
+  /* It returns a zeroed sqe, submitting the queued ones if the queue is
+   * full. */
+  auto get_sqe() -> io_uring_sqe * {
+    if (sq_local_tail - load_acquire(sq_head) >= sq_entries) {
+      submit(0);
+    }
+    auto *sqe = &sqes[sq_local_tail & sq_mask];
+    std::memset(sqe, 0, sizeof(*sqe));
+    ++sq_local_tail;
+    ++sq_pending;
+    return sqe;
+  }
+
+  /* It submits every queued sqe and waits for min_complete completions. */
+  auto submit(unsigned min_complete) -> int {
+    store_release(sq_tail, sq_local_tail);
+    auto to_submit = sq_pending;
+    sq_pending = 0;
+    int ret;
+    do {
+      ret = io_uring_enter(fd, to_submit, min_complete,
+                           min_complete > 0 ? IORING_ENTER_GETEVENTS : 0);
+      /* The kernel consumed the sqes even if the wait was interrupted. */
+      to_submit = 0;
+    } while (ret < 0 && errno == EINTR && min_complete == 0);
+    return ret;
+  }
+
+  /* It calls f(cqe) for every available completion and consumes them. */
+  template <class F> auto for_each_completion(F &&f) -> void {
+    auto head = *cq_head;
+    auto tail = load_acquire(cq_tail);
+    for (; head != tail; ++head) {
+      f(cqes[head & cq_mask]);
+    }
+    store_release(cq_head, head);
+  }
+};
+
+UringThread::UringThread(int listen_fd, Store store, WorkerPool *workers)
+    : ServerLoop(listen_fd, store, workers),
+      ring(std::make_unique<Ring>()) {
+  if (!ring->init()) {
+    perror("Error setting up io_uring");
+    exit(1);
+  }
+  /* The wakeup read is driven by the ring, it has to block there. */
+  fcntl(wakeup_fd, F_SETFL, fcntl(wakeup_fd, F_GETFL, 0) & ~O_NONBLOCK);
+  arm_accept();
+  arm_wakeup();
+}
+
+UringThread::~UringThread() {
+  for (auto &[id, conn] : connections) {
+    close(conn.fd);
+  }
+}
+
+auto UringThread::supported() -> bool {
+  utsname name{};
+  if (uname(&name) < 0) {
+    return false;
+  }
+  int major = 0;
+  int minor = 0;
+  if (sscanf(name.release, "%d.%d", &major, &minor) != 2 || major < 6) {
+    return false;
+  }
+  Ring probe;
+  return probe.init();
+}
+
+auto UringThread::arm_accept() -> void {
+  auto *sqe = ring->get_sqe();
+  sqe->opcode = IORING_OP_ACCEPT;
+  sqe->fd = listen_fd;
+  sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+  sqe->user_data = user_data(Op::accept);
+}
+
+auto UringThread::arm_recv(uint64_t conn_id, UringConnection &conn) -> void {
+  auto *sqe = ring->get_sqe();
+  sqe->opcode = IORING_OP_RECV;
+  sqe->fd = conn.fd;
+  sqe->ioprio = IORING_RECV_MULTISHOT;
+  sqe->flags = IOSQE_BUFFER_SELECT;
+  sqe->buf_group = recv_buffer_group;
+  sqe->user_data = user_data(Op::recv, conn_id);
+  conn.recv_armed = true;
+  conn.cancelling = false;
+}
+
+/**
+ * It cancels the multishot recv of the connection, whose last completion then
+ * lands in on_recv(); the cancellation only reports a failure, e.g. if the
+ * recv already ended.
+ */
+auto UringThread::cancel_recv(uint64_t conn_id, UringConnection &conn)
+    -> void {
+  auto *sqe = ring->get_sqe();
+  sqe->opcode = IORING_OP_ASYNC_CANCEL;
+  sqe->addr = user_data(Op::recv, conn_id);
+  sqe->flags = IOSQE_CQE_SKIP_SUCCESS;
+  sqe->user_data = user_data(Op::cancel, conn_id);
+  conn.cancelling = true;
+}
+
+auto UringThread::arm_wakeup() -> void {
+  auto *sqe = ring->get_sqe();
+  sqe->opcode = IORING_OP_READ;
+  sqe->fd = wakeup_fd;
+  sqe->addr = reinterpret_cast<uint64_t>(&wakeup_value);
+  sqe->len = sizeof(wakeup_value);
+  sqe->user_data = user_data(Op::wakeup);
+}
+
+/**
+ * It sends the pending responses of the connection, unless a send is already
+ * in flight; the bytes of the send in flight must stay put until it
+ * completes.
+ */
+auto UringThread::start_send(uint64_t conn_id, UringConnection &conn) -> void {
+  if (conn.send_in_flight || conn.broken) {
+    return;
+  }
+  if (conn.sent == conn.sending.size()) {
+    if (conn.out.empty()) {
+      return;
+    }
+    conn.sending.clear();
+    conn.sending.swap(conn.out);
+    conn.sent = 0;
+  }
+  auto *sqe = ring->get_sqe();
+  sqe->opcode = IORING_OP_SEND;
+  sqe->fd = conn.fd;
+  sqe->addr = reinterpret_cast<uint64_t>(conn.sending.data() + conn.sent);
+  sqe->len = static_cast<uint32_t>(conn.sending.size() - conn.sent);
+  sqe->msg_flags = MSG_NOSIGNAL;
+  sqe->user_data = user_data(Op::send, conn_id);
+  conn.send_in_flight = true;
+}
+
+auto UringThread::run() -> void {
+  while (true) {
+    if (ring->submit(1) < 0 && errno != EINTR) {
+      perror("Error in io_uring_enter");
+      return;
+    }
+    ring->for_each_completion([this](io_uring_cqe const &cqe) {
+      auto conn_id = cqe.user_data & id_mask;
+      switch (static_cast<Op>(cqe.user_data >> op_shift)) {
+      case Op::accept:
+        on_accept(cqe.res, cqe.flags);
+        break;
+      case Op::recv:
+        on_recv(conn_id, cqe.res, cqe.flags);
+        break;
+      case Op::send:
+        on_send(conn_id, cqe.res);
+        break;
+      case Op::wakeup:
+        on_wakeup();
+        break;
+      case Op::provide:
+        debug_print("[{}] providing receive buffers failed: {}\n", __func__,
+                    ErrNo(-cqe.res).msg());
+        break;
+      case Op::cancel:
+        break;
+      }
+    });
+    if (recycled && !starved.empty()) {
+      feed_starved();
+    }
+  }
+}
+
+auto UringThread::on_accept(int32_t res, uint32_t flags) -> void {
+  if (res >= 0) {
+    set_nonblocking(res);
+    auto id = ++next_conn_id;
+    auto &conn = connections[id];
+    conn.fd = res;
+    arm_recv(id, conn);
+  } else if (res != -EAGAIN) {
+    debug_print("[{}] accept failed: {}\n", __func__, ErrNo(-res).msg());
+  }
+  if (!(flags & IORING_CQE_F_MORE)) {
+    arm_accept();
+  }
+}
+
+auto UringThread::on_recv(uint64_t conn_id, int32_t res, uint32_t flags)
+    -> void {
+  auto it = connections.find(conn_id);
+  if (flags & IORING_CQE_F_BUFFER) {
+    auto bid = static_cast<uint16_t>(flags >> IORING_CQE_BUFFER_SHIFT);
+    if (it != connections.end() && res > 0) {
+      it->second.in.append(ring->buffer(bid), res);
+    }
+    ring->recycle_buffer(bid);
+    recycled = true;
+  }
+  if (it == connections.end()) {
+    return;
+  }
+  auto &conn = it->second;
+  bool more = (flags & IORING_CQE_F_MORE) != 0;
+  if (!more) {
+    conn.recv_armed = false;
+  }
+  if (res == 0) {
+    conn.peer_closed = true;
+  } else if (res == -ENOBUFS && !more) {
+    /* Armed again at once, it would fail again until buffers come back */
+    conn.starved = true;
+    starved.push_back(conn_id);
+  } else if (res < 0 && res != -ENOBUFS && res != -EAGAIN &&
+             res != -ECANCELED) {
+    conn.broken = true;
+  }
+  settle(conn_id, conn);
+}
+
+auto UringThread::on_send(uint64_t conn_id, int32_t res) -> void {
+  auto it = connections.find(conn_id);
+  if (it == connections.end()) {
+    return;
+  }
+  auto &conn = it->second;
+  conn.send_in_flight = false;
+  if (res < 0) {
+    conn.broken = true;
+  } else {
+    conn.sent += res;
+  }
+  settle(conn_id, conn);
+}
+
+auto UringThread::on_wakeup() -> void {
+  run_posted();
+  for (auto &batch : take_completions()) {
+    auto conn_id = batch->conn_id;
+    auto it = connections.find(conn_id);
+    if (it == connections.end()) {
+      continue;
+    }
+    auto &conn = it->second;
+    finish(conn, std::move(batch));
+    settle(conn_id, conn);
+  }
+  arm_wakeup();
+}
+
+/**
+ * It arms the recvs that ran out of buffers again, once buffers were handed
+ * back to the kernel since the last time; the provisions go to the kernel
+ * before the new recvs.
+ */
+auto UringThread::feed_starved() -> void {
+  recycled = false;
+  for (auto conn_id : std::exchange(starved, {})) {
+    auto it = connections.find(conn_id);
+    if (it == connections.end()) {
+      continue;
+    }
+    it->second.starved = false;
+    settle(conn_id, it->second);
+  }
+}
+
+/**
+ * It moves the connection forward after a completion: dispatches the buffered
+ * requests, sends the responses, stops or resumes receiving depending on how
+ * full the receive buffer is, and closes the connection once it is broken,
+ * or once the peer is gone and nothing is left to do for it. The fd is only
+ * closed when no operation on it is in flight anymore.
+ */
+auto UringThread::settle(uint64_t conn_id, UringConnection &conn) -> void {
+  if (!conn.broken && !dispatch(conn_id, conn)) {
+    conn.broken = true;
+  }
+  start_send(conn_id, conn);
+  bool full = conn.in.size() >= max_buffered_input;
+  if (!conn.broken && !conn.peer_closed) {
+    if (conn.recv_armed && full && !conn.cancelling) {
+      cancel_recv(conn_id, conn);
+    } else if (!conn.recv_armed && !full && !conn.starved) {
+      arm_recv(conn_id, conn);
+    }
+  }
+  bool idle = conn.in_flight == 0 && conn.out.empty() && !conn.send_in_flight &&
+              conn.sent == conn.sending.size();
+  if (!conn.broken && !(conn.peer_closed && idle)) {
+    return;
+  }
+  if (conn.recv_armed) {
+    /* Terminates the multishot recv; its last completion lands here again. */
+    shutdown(conn.fd, SHUT_RDWR);
+    return;
+  }
+  if (conn.send_in_flight || conn.in_flight > 0) {
+    return;
+  }
+  close(conn.fd);
+  connections.erase(conn_id);
+}
@@ -0,0 +1,74 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "server_thread.h"
+
+/**
+ ** The io_uring transport.
+ **
+ ** One multishot accept on the listening socket and one multishot recv per
+ ** connection stay armed, so the kernel keeps producing completions without
+ ** new submissions. Received data lands in a pool of buffers provided to the
+ ** kernel up front and handed back as soon as it is copied out. Once a
+ ** connection buffers max_buffered_input bytes of requests its recv is
+ ** cancelled, and armed again when its requests ran. All
+ ** submissions queued while handling a round of completions go to the kernel
+ ** with the single io_uring_enter call that also waits for the next round.
+ **
+ ** It needs Linux 6.0 or newer; use UringThread::supported() to fall back to
+ ** the epoll transport on older kernels.
+ **/
+class UringThread : public ServerLoop {
+public:
+  UringThread(int listen_fd, Store store, WorkerPool *workers);
+  ~UringThread() override;
+
+  UringThread(UringThread const &) = delete;
+  UringThread(UringThread &&) = delete;
+  auto operator=(UringThread const &) -> UringThread & = delete;
+  auto operator=(UringThread &&) -> UringThread & = delete;
+
+  auto run() -> void override;
+
+  /**
+   ** It probes whether the running kernel provides everything this transport
+   ** needs (multishot accept and recv, provided buffers).
+   **/
+  [[nodiscard]] static auto supported() -> bool;
+
+private:
+  struct Ring;
+
+  struct UringConnection : Connection {
+    std::string sending; // the bytes of the send in flight
+    size_t sent{0};
+    bool send_in_flight{false};
+    bool recv_armed{false};
+    bool cancelling{false}; // the recv is being cancelled, the buffer is full
+    bool starved{false};    // the recv ran out of buffers, waits for some
+    bool broken{false};
+  };
+
+  auto arm_accept() -> void;
+  auto arm_recv(uint64_t conn_id, UringConnection &conn) -> void;
+  auto cancel_recv(uint64_t conn_id, UringConnection &conn) -> void;
+  auto arm_wakeup() -> void;
+  auto start_send(uint64_t conn_id, UringConnection &conn) -> void;
+  auto on_accept(int32_t res, uint32_t flags) -> void;
+  auto on_recv(uint64_t conn_id, int32_t res, uint32_t flags) -> void;
+  auto on_send(uint64_t conn_id, int32_t res) -> void;
+  auto on_wakeup() -> void;
+  auto feed_starved() -> void;
+  auto settle(uint64_t conn_id, UringConnection &conn) -> void;
+
+  std::unique_ptr<Ring> ring;
+  uint64_t wakeup_value{0};
+  std::vector<uint64_t> starved; // connections whose recv waits for buffers
+  bool recycled{false}; // buffers went back to the kernel since feed_starved()
+  std::unordered_map<uint64_t, UringConnection> connections;
+};
@@ -0,0 +1,47 @@
+#include <chrono>
+
+#include "value_ttl.h"
+
+auto now_ms() -> int64_t {
+  return std::chrono::duration_cast<std::chrono::milliseconds>(
+             std::chrono::system_clock::now().time_since_epoch())
+      .count();
+}
+
+auto store_value(rocksdb::Slice value, int64_t expires_at_ms,
+                 std::string *scratch) -> rocksdb::Slice {
+  if (expires_at_ms == 0 && (value.empty() || value[0] != ttl_tag)) {
+    return value;
+  }
+  auto bits = static_cast<uint64_t>(expires_at_ms);
+  scratch->assign(1, ttl_tag);
+  for (size_t i = 0; i < sizeof(bits); ++i) {
+    scratch->push_back(static_cast<char>(bits >> (8 * i)));
+  }
+  scratch->append(value.data(), value.size());
+  return *scratch;
+}
+
+auto load_value(rocksdb::Slice stored) -> StoredValue {
+  if (stored.size() < ttl_header_size || stored[0] != ttl_tag) {
+    return {stored, 0};
+  }
+  uint64_t bits = 0;
+  for (size_t i = 0; i < sizeof(bits); ++i) {
+    bits |= static_cast<uint64_t>(static_cast<unsigned char>(stored[1 + i]))
+            << (8 * i);
+  }
+  stored.remove_prefix(ttl_header_size);
+  return {stored, static_cast<int64_t>(bits)};
+}
+
+auto TtlCompactionFilter::Filter(int /*level*/, rocksdb::Slice const & /*key*/,
+                                 rocksdb::Slice const &existing_value,
+                                 std::string * /*new_value*/,
+                                 bool * /*value_changed*/) const -> bool {
+  return load_value(existing_value).expired(now_ms());
+}
+
+auto TtlCompactionFilter::Name() const -> const char * {
+  return "TtlCompactionFilter";
+}
@@ -0,0 +1,54 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+
+#include "rocksdb/compaction_filter.h"
+#include "rocksdb/slice.h"
+
+/**
+ ** Values with an expiry time.
+ **
+ ** A value that expires is stored as ttl_tag, its expiry in milliseconds of
+ ** the system clock as a little-endian int64, and the value. Every other value
+ ** is stored as is, unless it starts with ttl_tag itself; then it gets the
+ ** header with an expiry of 0, which never expires, so no value is misread.
+ ** A GET hides an expired value, and the TtlCompactionFilter drops it once
+ ** RocksDB compacts its file, so expired keys need no DELETE.
+ **/
+
+inline constexpr char ttl_tag = '\x01';
+inline constexpr size_t ttl_header_size = 1 + sizeof(int64_t);
+
+/* A stored value taken apart; expires_at_ms is 0 if it never expires. */
+struct StoredValue {
+  rocksdb::Slice value;
+  int64_t expires_at_ms;
+
+  [[nodiscard]] auto expired(int64_t now) const -> bool {
+    return expires_at_ms != 0 && expires_at_ms <= now;
+  }
+};
+
+/* Milliseconds since the epoch, which survive a restart unlike a steady clock. */
+auto now_ms() -> int64_t;
+
+/**
+ ** It gives the stored form of value, which is value itself if it needs no
+ ** header, and otherwise built in scratch.
+ **/
+auto store_value(rocksdb::Slice value, int64_t expires_at_ms,
+                 std::string *scratch) -> rocksdb::Slice;
+
+auto load_value(rocksdb::Slice stored) -> StoredValue;
+
+/**
+ ** The compaction filter of the RocksDB engine, which drops expired values.
+ **/
+class TtlCompactionFilter : public rocksdb::CompactionFilter {
+public:
+  auto Filter(int level, rocksdb::Slice const &key,
+              rocksdb::Slice const &existing_value, std::string *new_value,
+              bool *value_changed) const -> bool override;
+  [[nodiscard]] auto Name() const -> const char * override;
+};
@@ -4,6 +4,7 @@ import sys
 import subprocess
 import time
 import psutil
+from typing import List, Tuple
 
 from testsupport import (
     run_project_executable,
@@ -18,29 +19,85 @@ def is_server_listening(port: int) -> bool:
             return True
     return False
 
-def run_client(port: int, operation: str, key: int, value: int, master_port: int, direct: int) -> int:
+def client_args(port: int, operation: str, key: int, value: int, master_port: int, direct: int, count: int,
+                ttl: int, binary: bool) -> List[str]:
+    args = [
+        "-p", str(port),
+        "-o", operation,
+        "-k", str(key),
+        "-v", str(value),
+        "-m", str(master_port),
+        "-d", str(direct),
+        "-n", str(count),
+    ]
+    if ttl > 0:
+        args += ["-t", str(ttl)]
+    if binary:
+        args.append("--binary")
+    return args
+
+def run_client(port: int, operation: str, key: int, value: int, master_port: int, direct: int, count: int = 1,
+               ttl: int = 0, binary: bool = False) -> int:
     info(
         f"Running client."
     )
 
+    with tempfile.TemporaryFile(mode="w+") as stdout:
+        proc = run_project_executable(
+            "clt",
+            args=client_args(port, operation, key, value, master_port, direct, count, ttl, binary),
+            stdout=stdout,
+            check=False
+        )
+
+        ret = proc.returncode
+
+        return ret
+
+def run_get(port: int, key: int, master_port: int, direct: int, binary: bool = False) -> Tuple[int, str]:
+    info(
+        f"Running get client."
+    )
+
+    with tempfile.TemporaryFile(mode="w+") as stdout:
+        proc = run_project_executable(
+            "clt",
+            args=client_args(port, "GET", key, 0, master_port, direct, 1, 0, binary),
+            stdout=stdout,
+            check=False
+        )
+        stdout.seek(0)
+
+        return proc.returncode, stdout.read().rstrip("\n")
+
+def run_scan(key: int, count: int, master_port: int, limit: int = 0) -> Tuple[int, List[Tuple[int, str]]]:
+    info(
+        f"Running scan client."
+    )
+
     with tempfile.TemporaryFile(mode="w+") as stdout:
         proc = run_project_executable(
             "clt",
             args=[
-                "-p", str(port),
-                "-o", operation,
+                "-p", "0",
+                "-o", "SCAN",
                 "-k", str(key),
-                "-v", str(value),
+                "-v", "0",
                 "-m", str(master_port),
-                "-d", str(direct),
+                "-d", "0",
+                "-n", str(count),
+                "-l", str(limit),
             ],
             stdout=stdout,
             check=False
         )
+        stdout.seek(0)
+        pairs = []
+        for line in stdout.read().splitlines():
+            pair_key, pair_value = line.split(" ", 1)
+            pairs.append((int(pair_key), pair_value))
 
-        ret = proc.returncode
-
-        return ret
+        return proc.returncode, pairs
 
 def run_master(port: int) -> Popen:
     # master always run with port number 1025
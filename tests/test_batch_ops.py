@@ -0,0 +1,50 @@
+#!/usr/bin/env python3
+
+import sys
+from time import sleep
+from testsupport import subtest, info, run
+from socketsupport import run_client, run_master, run_server
+
+
+def main() -> None:
+    with subtest("Testing MULTIPUT and MULTIGET across two shards"):
+        master_proc = run_master(1025)
+        sleep(5)
+        server_proc_one = run_server(1026, 1025)
+        sleep(5)
+        server_proc_two = run_server(1027, 1025)
+        sleep(5)
+
+        def stop(code: int) -> None:
+            master_proc.terminate()
+            server_proc_one.terminate()
+            server_proc_two.terminate()
+            sys.exit(code)
+
+        client_ret = run_client(1026, "MULTIGET", 1, 1000, 1025, 0, 20)
+        if client_ret != 2:
+            stop(1)
+        sleep(1)
+        client_ret = run_client(1026, "MULTIPUT", 1, 1000, 1025, 0, 20)
+        if client_ret != 0:
+            stop(1)
+        sleep(1)
+        client_ret = run_client(1026, "MULTIGET", 1, 1000, 1025, 0, 20)
+        if client_ret != 0:
+            stop(1)
+        sleep(1)
+        for i in range(1, 21):
+            client_ret = run_client(1026, "GET", i, 1000, 1025, 0)
+            if client_ret != 0:
+                stop(1)
+        client_ret = run_client(1026, "MULTIGET", 15, 1000, 1025, 0, 10)
+        if client_ret != 2:
+            stop(1)
+
+        info(f"ran all clients successfully")
+
+        stop(0)
+
+
+if __name__ == "__main__":
+    main()
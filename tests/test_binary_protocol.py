@@ -0,0 +1,71 @@
+#!/usr/bin/env python3
+
+import sys
+from time import sleep
+from testsupport import subtest, info, run
+from socketsupport import run_client, run_get, run_master, run_server
+
+
+def main() -> None:
+    with subtest("Testing binary and protobuf clients on the same shards"):
+        master_proc = run_master(1025)
+        sleep(5)
+        server_proc_one = run_server(1026, 1025)
+        sleep(5)
+        server_proc_two = run_server(1027, 1025)
+        sleep(5)
+
+        def stop(code: int) -> None:
+            master_proc.terminate()
+            server_proc_one.terminate()
+            server_proc_two.terminate()
+            sys.exit(code)
+
+        def check(key: int, expected: str) -> None:
+            for binary in (False, True):
+                get_ret, value = run_get(1026, key, 1025, 0, binary=binary)
+                if get_ret != 0 or value != expected:
+                    stop(1)
+
+        # Binary PUTs, read by both encodings and by a MULTIGET
+        for i in range(1, 11):
+            client_ret = run_client(1026, "PUT", i, 1000 + i, 1025, 0, binary=True)
+            if client_ret != 0:
+                stop(1)
+        for i in range(1, 11):
+            check(i, str(1000 + i))
+        client_ret = run_client(1026, "MULTIGET", 1, 0, 1025, 0, 10)
+        if client_ret != 0:
+            stop(1)
+
+        # A MULTIPUT, read by both encodings
+        client_ret = run_client(1026, "MULTIPUT", 11, 2000, 1025, 0, 10)
+        if client_ret != 0:
+            stop(1)
+        for i in range(11, 21):
+            check(i, "2000")
+
+        # Counter updates in both encodings on the same key
+        client_ret = run_client(1026, "SET", 21, 5, 1025, 0, binary=True)
+        if client_ret != 0:
+            stop(1)
+        client_ret = run_client(1026, "ADD", 21, 7, 1025, 0)
+        if client_ret != 0:
+            stop(1)
+        client_ret = run_client(1026, "MULT", 21, 2, 1025, 0, binary=True)
+        if client_ret != 0:
+            stop(1)
+        check(21, "24")
+
+        # A binary GET of a missing key
+        get_ret, value = run_get(1026, 22, 1025, 0, binary=True)
+        if get_ret != 2:
+            stop(1)
+
+        info(f"ran all clients successfully")
+
+        stop(0)
+
+
+if __name__ == "__main__":
+    main()
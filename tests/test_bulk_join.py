@@ -0,0 +1,52 @@
+#!/usr/bin/env python3
+
+import sys
+from time import sleep
+from testsupport import subtest, info, run
+from socketsupport import run_client, run_master, run_server
+
+
+def main() -> None:
+    with subtest("Testing the bulk move of keys when a new shard joins"):
+        master_proc = run_master(1025)
+        sleep(5)
+        server_proc_one = run_server(1026, 1025)
+        sleep(5)
+        server_proc_two = run_server(1027, 1025)
+        sleep(5)
+        server_procs = [server_proc_one, server_proc_two]
+
+        def stop(code: int) -> None:
+            master_proc.terminate()
+            for server_proc in server_procs:
+                server_proc.terminate()
+            sys.exit(code)
+
+        # enough keys that every server pair moves them as one SST file
+        client_ret = run_client(1026, "MULTIPUT", 1, 1000, 1025, 0, 1000)
+        if client_ret != 0:
+            stop(1)
+        sleep(1)
+
+        server_procs.append(run_server(1028, 1025))
+        sleep(10)
+
+        info(f"Testing key redistribution")
+        client_ret = run_client(1026, "MULTIGET", 1, 1000, 1025, 0, 1000)
+        if client_ret != 0:
+            stop(1)
+        at_least_one_get = False
+        for i in range(1, 21):
+            client_ret = run_client(1028, "GET", i, 1000, 1025, 1)
+            if client_ret == 0:
+                at_least_one_get = True
+        if not at_least_one_get:
+            stop(1)
+
+        info(f"ran all clients successfully")
+
+        stop(0)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,72 @@
+#!/usr/bin/env python3
+
+import sys
+from time import sleep
+from testsupport import subtest, info, run
+from socketsupport import run_client, run_get, run_master, run_server
+
+
+# Counter updates on one key and the value of the counter after each of them
+UPDATES = [
+    ("SET", 10, 10),
+    ("ADD", 5, 15),
+    ("MULT", 4, 60),
+    ("SUB", 18, 42),
+    ("DIV", 5, 8),
+    ("DIV", 0, 8),
+    ("MOD", 5, 3),
+    ("XOR", 6, 5),
+    ("OR", 8, 13),
+    ("AND", 7, 5),
+    ("NOT", 0, -6),
+]
+
+
+def main() -> None:
+    with subtest("Testing counter updates across a join"):
+        master_proc = run_master(1025)
+        sleep(5)
+        server_proc_one = run_server(1026, 1025)
+        sleep(5)
+        server_procs = [server_proc_one]
+
+        def stop(code: int) -> None:
+            master_proc.terminate()
+            for proc in server_procs:
+                proc.terminate()
+            sys.exit(code)
+
+        for operation, operand, expected in UPDATES:
+            client_ret = run_client(1026, operation, 1, operand, 1025, 0)
+            if client_ret != 0:
+                stop(1)
+            get_ret, value = run_get(1026, 1, 1025, 0)
+            if get_ret != 0 or value != str(expected):
+                stop(1)
+
+        # Some of the counters move to the new shard
+        for i in range(2, 12):
+            client_ret = run_client(1026, "ADD", i, i, 1025, 0)
+            if client_ret != 0:
+                stop(1)
+        server_procs.append(run_server(1027, 1025))
+        sleep(10)
+
+        for i in range(2, 12):
+            client_ret = run_client(1026, "MULT", i, 3, 1025, 0)
+            if client_ret != 0:
+                stop(1)
+            get_ret, value = run_get(1026, i, 1025, 0)
+            if get_ret != 0 or value != str(3 * i):
+                stop(1)
+        get_ret, value = run_get(1026, 1, 1025, 0)
+        if get_ret != 0 or value != "-6":
+            stop(1)
+
+        info(f"ran all clients successfully")
+
+        stop(0)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,45 @@
+#!/usr/bin/env python3
+
+import sys
+from time import sleep
+from testsupport import subtest, info, run
+from socketsupport import run_client, run_master, run_server, run_scan
+
+
+def main() -> None:
+    with subtest("Testing SCAN across two shards"):
+        master_proc = run_master(1025)
+        sleep(5)
+        server_proc_one = run_server(1026, 1025)
+        sleep(5)
+        server_proc_two = run_server(1027, 1025)
+        sleep(5)
+
+        def stop(code: int) -> None:
+            master_proc.terminate()
+            server_proc_one.terminate()
+            server_proc_two.terminate()
+            sys.exit(code)
+
+        for i in range(1, 31):
+            client_ret = run_client(1026, "PUT", i, 1000 + i, 1025, 0)
+            if client_ret != 0:
+                stop(1)
+        sleep(1)
+        scan_ret, pairs = run_scan(5, 20, 1025)
+        if scan_ret != 0 or pairs != [(i, str(1000 + i)) for i in range(5, 25)]:
+            stop(1)
+        scan_ret, pairs = run_scan(25, 100, 1025, 3)
+        if scan_ret != 0 or pairs != [(i, str(1000 + i)) for i in range(25, 28)]:
+            stop(1)
+        scan_ret, pairs = run_scan(100, 10, 1025)
+        if scan_ret != 0 or pairs != []:
+            stop(1)
+
+        info(f"ran all clients successfully")
+
+        stop(0)
+
+
+if __name__ == "__main__":
+    main()
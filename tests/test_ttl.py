@@ -0,0 +1,45 @@
+#!/usr/bin/env python3
+
+import sys
+from time import sleep
+from testsupport import subtest, info, run
+from socketsupport import run_client, run_get, run_master, run_server
+
+
+def main() -> None:
+    with subtest("Testing keys that expire"):
+        master_proc = run_master(1025)
+        sleep(5)
+        server_proc_one = run_server(1026, 1025)
+        sleep(5)
+
+        def stop(code: int) -> None:
+            master_proc.terminate()
+            server_proc_one.terminate()
+            sys.exit(code)
+
+        client_ret = run_client(1026, "PUT", 1, 1000, 1025, 0, ttl=3000)
+        if client_ret != 0:
+            stop(1)
+        client_ret = run_client(1026, "PUT", 2, 2000, 1025, 0)
+        if client_ret != 0:
+            stop(1)
+        get_ret, value = run_get(1026, 1, 1025, 0)
+        if get_ret != 0 or value != "1000":
+            stop(1)
+        sleep(4)
+        get_ret, value = run_get(1026, 1, 1025, 0)
+        if get_ret != 2:
+            stop(1)
+        # A key without a TTL never expires
+        get_ret, value = run_get(1026, 2, 1025, 0)
+        if get_ret != 0 or value != "2000":
+            stop(1)
+
+        info(f"ran all clients successfully")
+
+        stop(0)
+
+
+if __name__ == "__main__":
+    main()